@@ -0,0 +1,18 @@
+#ifndef EH_ATTRIBUTES_H
+#define EH_ATTRIBUTES_H
+
+// per-particle attributes carried along by grid_sort
+// X( buffer name, element type ); type is int, ehfloat or ehvec3
+#define EH_PARTICLE_ATTRIBUTES(X) \
+  X(position, ehvec3)             \
+  X(velocity, ehvec3)             \
+  X(svelocity, ehvec3)            \
+  X(flags, int)                   \
+  X(color, int)
+
+// attributes only the IISPH solve keeps from one step to the next, its
+// previous pressure being the initial guess; grid_sort carries them along
+// only with param_t::iisph (EH_IISPH in kernels.cl)
+#define EH_IISPH_ATTRIBUTES(X) X(pressure, ehfloat)
+
+#endif
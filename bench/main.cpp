@@ -0,0 +1,632 @@
+#include "engine.hpp"
+#include "native_engine.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+
+// Headless benchmark: a dam-break column of fluid inside a box of static
+// walls, stepped a fixed number of times after a warm-up.
+//
+//   sph_bench [--particles N] [--h H] [--eta ETA] [--domain X Y Z]
+//             [--steps N] [--warmup N] [--format json|csv] [--output FILE]
+//             [--morton] [--specialize] [--adaptive-dt] [--iisph]
+//             [--no-profile] [--device SELECTOR] [--local-size N]
+//             [--backend opencl|native] [--threads N] [--validate]
+//             [--forces particle|tiled|auto] [--half-neighbors]
+//
+// --device takes the same selectors as SPH_DEVICE (see param_t::device).
+// --validate also runs the scene on the other backend and compares the
+// fluid state after the same number of steps.
+// --forces picks the per-particle or the cell-tiled force kernels, or lets
+// the engine time both during the warm-up (see param_t::tune_forces).
+// --half-neighbors evaluates each pair once, native backend only (see
+// param_t::half_neighbors).
+// Results go to stdout (or --output); everything the engine prints goes to
+// stderr so the output stays machine-readable.
+
+struct bench_t
+{
+  int particles = 100000;
+  ehfloat h = 0.08;
+  ehfloat eta = 2.5;
+  ehfloat domain[3] = { 2, 1, 1 };
+  int steps = 200;
+  int warmup = 20;
+  std::string format = "json";
+  std::string output;
+  bool morton = false;
+  bool specialize = false;
+  bool adaptive_dt = false;
+  bool iisph = false;
+  bool profile = true;
+  std::string device;
+  int local_size = 0;
+  std::string backend = "opencl";
+  int threads = 0;
+  bool validate = false;
+  std::string forces = "particle";
+  bool half_neighbors = false;
+};
+
+static void usage()
+{
+  std::cerr << "usage: sph_bench [--particles N] [--h H] [--eta ETA] "
+               "[--domain X Y Z]\n"
+               "                 [--steps N] [--warmup N] [--format json|csv] "
+               "[--output FILE]\n"
+               "                 [--morton] [--specialize] [--adaptive-dt] "
+               "[--iisph]\n"
+               "                 [--no-profile] [--device SELECTOR] "
+               "[--local-size N]\n"
+               "                 [--backend opencl|native] [--threads N] "
+               "[--validate]\n"
+               "                 [--forces particle|tiled|auto] "
+               "[--half-neighbors]\n";
+  std::exit(1);
+}
+
+static bench_t parse_args(int argc, char** argv)
+{
+  bench_t b;
+  if (char const* device = std::getenv("SPH_DEVICE"))
+  {
+    b.device = device;
+  }
+  for (int i = 1; i < argc; ++i)
+  {
+    char const* arg = argv[i];
+    // number of values following arg
+    auto values = [&](int n) {
+      if (i + n >= argc)
+      {
+        usage();
+      }
+      char** v = argv + i + 1;
+      i += n;
+      return v;
+    };
+    if (std::strcmp(arg, "--particles") == 0)
+    {
+      b.particles = std::atoi(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--h") == 0)
+    {
+      b.h = std::atof(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--eta") == 0)
+    {
+      b.eta = std::atof(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--domain") == 0)
+    {
+      char** v = values(3);
+      for (int d = 0; d < 3; ++d)
+      {
+        b.domain[d] = std::atof(v[d]);
+      }
+    }
+    else if (std::strcmp(arg, "--steps") == 0)
+    {
+      b.steps = std::atoi(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--warmup") == 0)
+    {
+      b.warmup = std::atoi(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--format") == 0)
+    {
+      b.format = values(1)[0];
+    }
+    else if (std::strcmp(arg, "--output") == 0)
+    {
+      b.output = values(1)[0];
+    }
+    else if (std::strcmp(arg, "--morton") == 0)
+    {
+      b.morton = true;
+    }
+    else if (std::strcmp(arg, "--specialize") == 0)
+    {
+      b.specialize = true;
+    }
+    else if (std::strcmp(arg, "--adaptive-dt") == 0)
+    {
+      b.adaptive_dt = true;
+    }
+    else if (std::strcmp(arg, "--iisph") == 0)
+    {
+      b.iisph = true;
+    }
+    else if (std::strcmp(arg, "--no-profile") == 0)
+    {
+      b.profile = false;
+    }
+    else if (std::strcmp(arg, "--device") == 0)
+    {
+      b.device = values(1)[0];
+    }
+    else if (std::strcmp(arg, "--local-size") == 0)
+    {
+      b.local_size = std::atoi(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--backend") == 0)
+    {
+      b.backend = values(1)[0];
+    }
+    else if (std::strcmp(arg, "--threads") == 0)
+    {
+      b.threads = std::atoi(values(1)[0]);
+    }
+    else if (std::strcmp(arg, "--forces") == 0)
+    {
+      b.forces = values(1)[0];
+      if (b.forces != "particle" && b.forces != "tiled" && b.forces != "auto")
+      {
+        usage();
+      }
+    }
+    else if (std::strcmp(arg, "--half-neighbors") == 0)
+    {
+      b.half_neighbors = true;
+    }
+    else if (std::strcmp(arg, "--validate") == 0)
+    {
+      b.validate = true;
+    }
+    else
+    {
+      usage();
+    }
+  }
+  if (b.particles <= 0 || b.h <= 0 || b.eta <= 0 || b.steps <= 0
+      || b.warmup < 0 || (b.format != "json" && b.format != "csv")
+      || (b.backend != "opencl" && b.backend != "native"))
+  {
+    usage();
+  }
+  return b;
+}
+
+// calls f(position, static) for every particle of the scene: walls
+// static_gap*h thick around [0,domain] and a fluid column against x=0
+// holding about b.particles particles
+template <typename F>
+static void for_each_particle(bench_t const& b, ehfloat gap, F f)
+{
+  ehfloat const static_gap = 1.1;
+  ehfloat const wall = static_gap * b.h;
+  ehfloat column = b.particles * gap * gap * gap
+                   / (b.domain[1] * b.domain[2]);
+  column = std::min(column, b.domain[0]);
+  for (ehfloat z = -wall; z < b.domain[2] + wall; z += gap)
+  {
+    for (ehfloat y = -wall; y < b.domain[1] + wall; y += gap)
+    {
+      for (ehfloat x = -wall; x < b.domain[0] + wall; x += gap)
+      {
+        if (x < 0 || y < 0 || z < 0 || x > b.domain[0] || y > b.domain[1]
+            || z > b.domain[2])
+        {
+          f(ehfloat3 { x, y, z }, true);
+        }
+        else if (x < column)
+        {
+          f(ehfloat3 { x, y, z }, false);
+        }
+      }
+    }
+  }
+}
+
+// kernel or transfer name from engine_t::profile_stats to a coarse phase
+static char const* phase_of(std::string const& name)
+{
+  auto starts = [&](char const* prefix) {
+    return name.compare(0, std::strlen(prefix), prefix) == 0;
+  };
+  if (starts("read ") || starts("write ") || starts("fill ")
+      || starts("copy ") || name == "get_buffer")
+  {
+    return "transfers";
+  }
+  if (starts("iisph_"))
+  {
+    return "pressure_solve";
+  }
+  if (name == "calculate_rho")
+  {
+    return "density";
+  }
+  if (starts("calculate_"))
+  {
+    return "forces";
+  }
+  if (starts("advect_"))
+  {
+    return "integrate";
+  }
+  if (starts("reduce_") || name == "update_dt")
+  {
+    return "reductions";
+  }
+  // grid sort, prefix sums and neighbor lists
+  return "neighbors";
+}
+static char const* const phases[]
+    = { "neighbors", "density",    "forces",   "pressure_solve",
+        "integrate", "reductions", "transfers" };
+
+// bytes a streaming kernel of engine_t moves per step, counted from its
+// arguments: the scalars of every particle, plus the vectors of the fluid
+// particles where static ones return early. Kernels that gather neighbors
+// are left out, their traffic depends on how many loads hit the cache.
+static double kernel_bytes(std::string const& name,
+                           int N,
+                           int fluid,
+                           bool iisph)
+{
+  double const i = sizeof(cl_int);
+  double const f = sizeof(ehfloat);
+  double const h = sizeof(ehhalf);
+  double const v = sizeof(ehvec3);
+  double const h3 = sizeof(ehhalf3);
+  if (name == "reorder_particles")
+  {
+    // position, velocity, svelocity, flags and color read and written;
+    // grid_localindex, gridindex and the cell start read, cellindex written
+    return N * (2 * (3 * v + 2 * i) + 4 * i + (iisph ? 2 * f : 0));
+  }
+  if (name == "advect_phase1")
+  {
+    // flags, rho and drho read, rho and p / rho^2 written; position,
+    // velocity and the nonpressure force read and written
+    return N * (i + 3 * f + h) + fluid * (4 * v + 2 * h3);
+  }
+  if (name == "advect_phase2")
+  {
+    // flags read; rho and the pressure force read, position, velocity and
+    // acceleration read and written
+    return N * i + fluid * (f + 5 * v + 2 * h3);
+  }
+  if (name == "calculate_pressure")
+  {
+    return N * (f + i + h);
+  }
+  return 0;
+}
+static char const* const bandwidth_kernels[]
+    = { "reorder_particles", "advect_phase1", "advect_phase2",
+        "calculate_pressure" };
+
+static param_t make_param(bench_t const& b)
+{
+  param_t param;
+  param.h = b.h;
+  param.eta = b.eta;
+  param.minbound = { -2 * b.h, -2 * b.h, -2 * b.h };
+  param.maxbound = { b.domain[0] + 2 * b.h, b.domain[1] + 2 * b.h,
+                     b.domain[2] + 2 * b.h };
+  param.Cs = 10;
+  param.gravity = { 0, -4.0, 0 };
+  param.mu = 0.02;
+  param.gamma = 7.0;
+  param.courant_dt_factor = 0.8;
+  param.diffusion_dt_factor = 0.8;
+  param.rho0 = 1;
+  param.sync_interval = 0;
+  param.morton_grid = b.morton;
+  param.specialize = b.specialize;
+  param.adaptive_dt = b.adaptive_dt;
+  param.iisph = b.iisph;
+  if (b.iisph)
+  {
+    param.max_dt_factor = 25;
+  }
+  param.profile = b.profile;
+  param.device = b.device;
+  param.local_size = b.local_size;
+  param.tiled_forces = b.forces == "tiled";
+  param.tune_forces = b.forces == "auto";
+  param.half_neighbors = b.half_neighbors;
+  param.threads = b.threads;
+
+  int count = 0;
+  for_each_particle(b, b.h / b.eta, [&](ehfloat3, bool) { ++count; });
+  param.max_particle_count = count;
+  return param;
+}
+
+// backend with the scene loaded and the mass calibrated
+static std::unique_ptr<backend_t> make_scene(bench_t const& b,
+                                             std::string const& backend)
+{
+  std::unique_ptr<backend_t> sph;
+  if (backend == "native")
+  {
+    sph = std::make_unique<native_engine_t>();
+  }
+  else
+  {
+    auto engine = std::make_unique<engine_t>();
+    engine->debug = false;
+    sph = std::move(engine);
+  }
+  param_t param = make_param(b);
+  sph->set(param);
+  sph->load();
+  for_each_particle(b, b.h / b.eta, [&](ehfloat3 position, bool is_static) {
+    particle_info_t info;
+    info.position = position;
+    info.velocity = { 0, 0, 0 };
+    info.svelocity = { 0, 0, 0 };
+    info.flag = is_static
+                    ? EH_PARTICLE_STATIC | EH_PARTICLE_STATICMOVE
+                          | EH_PARTICLE_NOFORCE
+                    : 0;
+    info.color = is_static ? 0 : 1;
+    sph->add_particle(info);
+  });
+  sph->calculate_mass();
+  return sph;
+}
+
+// fluid state compared by --validate; particle order differs between
+// backends, so only order-independent quantities
+struct summary_t
+{
+  int N = 0;
+  ehfloat center[3] = { 0, 0, 0 };
+  ehfloat mean_speed = 0;
+  ehfloat mean_rho = 0;
+};
+static summary_t summarize(backend_t& sph)
+{
+  std::vector<ehfloat3> position, velocity;
+  std::vector<ehfloat> rho;
+  std::vector<cl_int> flags;
+  sph.sync();
+  sph.read_particles(position, velocity, rho, flags);
+  summary_t s;
+  s.N = (int)position.size();
+  int fluid = 0;
+  for (size_t i = 0; i < position.size(); ++i)
+  {
+    if (flags[i] & EH_PARTICLE_STATIC)
+    {
+      continue;
+    }
+    ++fluid;
+    ehfloat speed2 = 0;
+    for (int d = 0; d < 3; ++d)
+    {
+      s.center[d] += position[i].s[d];
+      speed2 += velocity[i].s[d] * velocity[i].s[d];
+    }
+    s.mean_speed += std::sqrt(speed2);
+    s.mean_rho += rho[i];
+  }
+  fluid = std::max(fluid, 1);
+  for (int d = 0; d < 3; ++d)
+  {
+    s.center[d] /= fluid;
+  }
+  s.mean_speed /= fluid;
+  s.mean_rho /= fluid;
+  return s;
+}
+
+int main(int argc, char** argv)
+{
+  bench_t b = parse_args(argc, argv);
+
+  // keep stdout for the results
+  std::streambuf* stdout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+
+  int fluid_count = 0;
+  int static_count = 0;
+  for_each_particle(b, b.h / b.eta, [&](ehfloat3, bool is_static) {
+    ++(is_static ? static_count : fluid_count);
+  });
+
+  std::unique_ptr<backend_t> sph = make_scene(b, b.backend);
+  for (int i = 0; i < b.warmup; ++i)
+  {
+    sph->step();
+  }
+  sph->sync();
+  sph->reset_profile();
+
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < b.steps; ++i)
+  {
+    sph->step();
+  }
+  sph->sync();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+
+  // ms per step, by phase and by kernel
+  std::map<std::string, double> phase_ms;
+  std::map<std::string, double> kernel_ms;
+  for (auto& it : sph->profile_totals())
+  {
+    kernel_ms[it.first] = it.second / b.steps;
+    phase_ms[phase_of(it.first)] += it.second / b.steps;
+  }
+  int N = sph->particle_count();
+  std::string device = sph->device_name();
+  int local_size = 0;
+  // vector storage; sph_bench built with and without SPH_SOA compares them
+  std::string layout = "native";
+  // variant of the nonpressure / pressure force kernels that ran
+  std::string forces_used = "particle/particle";
+  char const* precision
+      = USE_MIXED == 1 ? "mixed" : USE_DOUBLE == 1 ? "double" : "float";
+  if (engine_t* engine = dynamic_cast<engine_t*>(sph.get()))
+  {
+    local_size = engine->prefix_sum_local_size;
+    layout = USE_SOA == 1 ? "soa" : "aos";
+    forces_used = std::string(engine->tiled_force[0] ? "tiled" : "particle")
+                  + "/" + (engine->tiled_force[1] ? "tiled" : "particle");
+  }
+  // GB/s of the streaming kernels, comparable between the aos and soa
+  // builds
+  std::map<std::string, double> kernel_gb_per_sec;
+  if (layout != "native")
+  {
+    for (char const* kernel : bandwidth_kernels)
+    {
+      double ms = kernel_ms[kernel];
+      if (ms > 0)
+      {
+        kernel_gb_per_sec[kernel]
+            = kernel_bytes(kernel, N, N - static_count, b.iisph) / ms * 1e-6;
+      }
+    }
+  }
+
+  // the same scene and number of steps on the other backend
+  ehfloat center_diff = 0;
+  ehfloat speed_diff = 0;
+  ehfloat rho_diff = 0;
+  bool passed = true;
+  if (b.validate)
+  {
+    summary_t s = summarize(*sph);
+    sph.reset();
+    auto other = make_scene(b, b.backend == "native" ? "opencl" : "native");
+    for (int i = 0; i < b.warmup + b.steps; ++i)
+    {
+      other->step();
+    }
+    summary_t r = summarize(*other);
+    for (int d = 0; d < 3; ++d)
+    {
+      center_diff += (s.center[d] - r.center[d]) * (s.center[d] - r.center[d]);
+    }
+    // in particle spacings, and relative
+    center_diff = std::sqrt(center_diff) * b.eta / b.h;
+    speed_diff = std::abs(s.mean_speed - r.mean_speed)
+                 / std::max(r.mean_speed, (ehfloat)1e-6);
+    rho_diff = std::abs(s.mean_rho - r.mean_rho) / r.mean_rho;
+    passed = s.N == r.N && center_diff < 0.05 && speed_diff < 0.01
+             && rho_diff < 0.001;
+  }
+
+  std::cout.rdbuf(stdout_buf);
+  std::ofstream file;
+  if (b.output.size() > 0)
+  {
+    file.open(b.output);
+  }
+  std::ostream& out = b.output.size() > 0 ? file : std::cout;
+  double steps_per_sec = b.steps / seconds;
+  double updates_per_sec = steps_per_sec * N;
+  out << std::setprecision(6);
+  if (b.format == "json")
+  {
+    out << "{\n"
+        << "  \"backend\": \"" << b.backend << "\",\n"
+        << "  \"device\": \"" << device << "\",\n"
+        << "  \"particles\": " << fluid_count << ",\n"
+        << "  \"static_particles\": " << static_count << ",\n"
+        << "  \"local_size\": " << local_size << ",\n"
+        << "  \"layout\": \"" << layout << "\",\n"
+        << "  \"precision\": \"" << precision << "\",\n"
+        << "  \"half_attributes\": " << (USE_HALF == 1 ? "true" : "false")
+        << ",\n"
+        << "  \"forces\": \"" << b.forces << "\",\n"
+        << "  \"forces_used\": \"" << forces_used << "\",\n"
+        << "  \"half_neighbors\": "
+        << (b.half_neighbors ? "true" : "false") << ",\n"
+        << "  \"N\": " << N << ",\n"
+        << "  \"h\": " << b.h << ",\n"
+        << "  \"eta\": " << b.eta << ",\n"
+        << "  \"domain\": [" << b.domain[0] << ", " << b.domain[1] << ", "
+        << b.domain[2] << "],\n"
+        << "  \"warmup\": " << b.warmup << ",\n"
+        << "  \"steps\": " << b.steps << ",\n"
+        << "  \"seconds\": " << seconds << ",\n"
+        << "  \"steps_per_sec\": " << steps_per_sec << ",\n"
+        << "  \"particle_updates_per_sec\": " << updates_per_sec << ",\n";
+    if (b.validate)
+    {
+      out << "  \"validation\": {\"center_diff\": " << center_diff
+          << ", \"speed_diff\": " << speed_diff
+          << ", \"rho_diff\": " << rho_diff
+          << ", \"passed\": " << (passed ? "true" : "false") << "},\n";
+    }
+    out << "  \"phase_ms_per_step\": {";
+    for (size_t i = 0; i < std::size(phases); ++i)
+    {
+      out << (i ? ", " : "") << "\"" << phases[i]
+          << "\": " << phase_ms[phases[i]];
+    }
+    out << "},\n  \"kernel_ms_per_step\": {";
+    bool first = true;
+    for (auto& it : kernel_ms)
+    {
+      out << (first ? "" : ",") << "\n    \"" << it.first
+          << "\": " << it.second;
+      first = false;
+    }
+    out << "\n  },\n  \"kernel_gb_per_sec\": {";
+    first = true;
+    for (auto& it : kernel_gb_per_sec)
+    {
+      out << (first ? "" : ", ") << "\"" << it.first << "\": " << it.second;
+      first = false;
+    }
+    out << "}\n}\n";
+  }
+  else
+  {
+    out << "backend,layout,precision,half_attributes,forces,forces_used,"
+           "half_neighbors,device,particles,static_particles,N,h,eta,"
+           "domain_x,domain_y,domain_z,warmup,steps,seconds,steps_per_sec,"
+           "particle_updates_per_sec";
+    for (char const* phase : phases)
+    {
+      out << "," << phase << "_ms";
+    }
+    for (char const* kernel : bandwidth_kernels)
+    {
+      out << "," << kernel << "_gb_per_sec";
+    }
+    if (b.validate)
+    {
+      out << ",center_diff,speed_diff,rho_diff,passed";
+    }
+    out << "\n"
+        << b.backend << "," << layout << "," << precision << "," << USE_HALF
+        << "," << b.forces << "," << forces_used << ","
+        << b.half_neighbors << ",\"" << device << "\","
+        << fluid_count << "," << static_count << "," << N << "," << b.h << ","
+        << b.eta << "," << b.domain[0] << "," << b.domain[1] << ","
+        << b.domain[2] << "," << b.warmup << "," << b.steps << "," << seconds
+        << "," << steps_per_sec << "," << updates_per_sec;
+    for (char const* phase : phases)
+    {
+      out << "," << phase_ms[phase];
+    }
+    for (char const* kernel : bandwidth_kernels)
+    {
+      out << "," << kernel_gb_per_sec[kernel];
+    }
+    if (b.validate)
+    {
+      out << "," << center_diff << "," << speed_diff << "," << rho_diff << ","
+          << passed;
+    }
+    out << "\n";
+  }
+  return passed ? 0 : 1;
+}
@@ -1,8 +1,29 @@
 #include "engine.hpp"
 #include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+static std::string read_source(char const* path)
+{
+  std::ifstream file(path);
+  file.seekg(0, std::ifstream::end);
+  size_t filesize = file.tellg();
+  std::string source;
+  source.resize(filesize);
+  file.seekg(0, std::ifstream::beg);
+  file.read(&source[0], filesize);
+  return source;
+}
 
 void engine_t::load_opencl()
 {
@@ -11,12 +32,36 @@ void engine_t::load_opencl()
     std::cout << "~~~~~OpenCL Initialize~~~~~~~\n";
   }
   int maxN = max_particle_count;
-  platform = cl::Platform::get();
+  select_device();
+  if (morton_grid
+      && (cl_ulong)(gridcells + 1) * sizeof(cl_int)
+             > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+  {
+    // the padded Z-order cube can be far larger than the bounding box, and
+    // grid_particlecount has to fit a single allocation
+    std::cout << "morton grid of " << gridcells
+              << " cells exceeds the device allocation limit, using "
+                 "row-major\n";
+    morton_grid = false;
+    gridcells = gridsize.s[0] * gridsize.s[1] * gridsize.s[2];
+  }
 
   {
-    std::vector<cl::Device> devices;
-    platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-    device = std::move(devices[0]);
+    // per-device defaults; build_program() still clamps the work-group
+    // sizes to what the kernels allow
+    bool cpu = (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+    int size = local_size > 0 ? local_size : (cpu ? 64 : 256);
+    prefix_sum_local_size = 1;
+    while (prefix_sum_local_size * 2 <= size)
+    {
+      prefix_sum_local_size <<= 1;
+    }
+    reduce_local_size = prefix_sum_local_size;
+    tile_local_size = prefix_sum_local_size;
+    // a CPU runs one work-group per core at a time; more groups than that
+    // only lengthen reduce_partial
+    int units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    reduce_groups = cpu ? std::max(2 * units, 2) : 64;
   }
 
   context = cl::Context(device);
@@ -44,6 +89,17 @@ void engine_t::load_opencl()
   {
     std::cout << "using double precision;\n";
   }
+#elif USE_MIXED == 1
+  if (double_support == false)
+  {
+    std::cout << "double not supported but using ehacc=double;\n";
+    throw std::runtime_error("double not supported error");
+  }
+
+  if (debug)
+  {
+    std::cout << "using mixed precision;\n";
+  }
 #else
   if (debug)
   {
@@ -54,64 +110,333 @@ void engine_t::load_opencl()
   // buffers
   constant_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(constant_t));
 
-  float3_pong = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
-  int_pong = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
-  position = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
-
-  velocity = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
-
-  svelocity = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
-
-  flags = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
+#define EH_ATTRIBUTE_ALLOC(name, type)                                   \
+  name = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(type)); \
+  pong.name = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(type));
+  EH_PARTICLE_ATTRIBUTES(EH_ATTRIBUTE_ALLOC)
+#undef EH_ATTRIBUTE_ALLOC
 
   rho = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat));
-  V = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat));
-
-  pressure = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat));
-  color = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
+  drho = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat));
+  pressure_rho2
+      = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehhalf));
+  V = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehhalf));
 
   nonpressure_force
-      = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
+      = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehhalf3));
   pressure_force
-      = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehfloat3));
+      = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(ehvec3));
 
   grid_localindex
       = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
   gridindex = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
+  cellindex = cl::Buffer(context, CL_MEM_READ_WRITE, maxN * sizeof(cl_int));
+  sort_state = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_int));
+  open_gate = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+  sort_stats_buffer
+      = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(cl_long));
+  build_position = cl::Buffer(
+      context, CL_MEM_READ_WRITE,
+      (incremental_sort || verlet_list ? maxN : 1) * sizeof(ehvec3));
+  reduce_partial
+      = cl::Buffer(context, CL_MEM_READ_WRITE, reduce_groups * sizeof(ehfloat));
+  reduce_result = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(ehfloat));
+  dt_state = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(ehfloat));
+  dt_ring = cl::Buffer(context, CL_MEM_READ_WRITE,
+                       (adaptive_dt ? dt_ring_size : 1) * sizeof(ehfloat));
+  {
+    // placeholders unless iisph
+    int n = iisph ? maxN : 1;
+#define EH_ATTRIBUTE_ALLOC(name, type)                                \
+  name = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(type)); \
+  pong.name = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(type));
+    EH_IISPH_ATTRIBUTES(EH_ATTRIBUTE_ALLOC)
+#undef EH_ATTRIBUTE_ALLOC
+    iisph_aii = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(ehfloat));
+    iisph_source = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(ehfloat));
+    iisph_error = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(ehfloat));
+    iisph_state = cl::Buffer(context, CL_MEM_READ_WRITE, 8 * sizeof(ehfloat));
+  }
 
-  int gs = gridsize.s[0] * gridsize.s[1] * gridsize.s[2];
+  int gs = gridcells;
   grid_particlecount
       = cl::Buffer(context, CL_MEM_READ_WRITE, (gs + 1) * sizeof(cl_int));
-  grid_particlecount2
-      = cl::Buffer(context, CL_MEM_READ_WRITE, (gs + 1) * sizeof(cl_int));
 
 #define MAX_NEIGHBORS 200
-  neighbors = cl::Buffer(context, CL_MEM_READ_WRITE,
-                         maxN * MAX_NEIGHBORS * sizeof(cl_int));
-  neighbor_count
-      = cl::Buffer(context, CL_MEM_READ_WRITE, (maxN + 1) * sizeof(cl_int));
+  neighbors_size = (size_t)maxN
+                   * (neighbor_stride > 0 ? neighbor_stride : MAX_NEIGHBORS);
+  spill_size = 0;
+  if (neighbor_stride > 0)
+  {
+    // room for the full lists of the particles that outgrow their slots
+    spill_size = neighbors_size / 2;
+    neighbors_size += spill_size;
+  }
+  if (neighbor_grid)
+  {
+    // kernels still take the arguments, but never read them
+    neighbors_size = 1;
+  }
+  neighbors
+      = cl::Buffer(context, CL_MEM_READ_WRITE, neighbors_size * sizeof(cl_int));
+  neighbor_overflow
+      = cl::Buffer(context, CL_MEM_READ_WRITE, 3 * sizeof(cl_int));
+  neighbor_count = cl::Buffer(context, CL_MEM_READ_WRITE,
+                              (neighbor_grid ? 1 : maxN + 1) * sizeof(cl_int));
+
+  queue = cl::CommandQueue(context, device,
+                           profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
 
-  queue = cl::CommandQueue(context, device);
+  build_program();
+
+  {
+    ehfloat state[2] = { dt, time };
+    queue.enqueueWriteBuffer(dt_state, CL_TRUE, 0, sizeof(state), state,
+                             nullptr, profile_event("write dt_state"));
+  }
+  queue.enqueueFillBuffer(iisph_state, ehfloat(0), 0, 8 * sizeof(ehfloat),
+                          nullptr, profile_event("fill iisph_state"));
+  queue.enqueueFillBuffer(neighbor_overflow, cl_int(0), 0,
+                          3 * sizeof(cl_int), nullptr,
+                          profile_event("fill neighbor_overflow"));
+  queue.enqueueFillBuffer(sort_stats_buffer, cl_long(0), 0,
+                          4 * sizeof(cl_long), nullptr,
+                          profile_event("fill sort_stats"));
+  {
+    // without incremental_sort or verlet_list every step sorts
+    cl_int2 state;
+    state.s[0] = 1;
+    state.s[1] = 0;
+    queue.enqueueFillBuffer(sort_state, state, 0, sizeof(state), nullptr,
+                            profile_event("fill sort_state"));
+  }
+  queue.enqueueFillBuffer(open_gate, cl_int(1), 0, sizeof(cl_int), nullptr,
+                          profile_event("fill open_gate"));
+  // the previous pressure is the initial guess of the solve
+  queue.enqueueFillBuffer(pressure, ehfloat(0), 0,
+                          (iisph ? maxN : 1) * sizeof(ehfloat), nullptr,
+                          profile_event("fill pressure"));
+  upload_constants();
+}
+// -D options baking the constants fixed for a run into the program; kernels
+// read them through the EH_H, EH_MASS, ... macros of kernels.cl
+std::string engine_t::specialization_options()
+{
+  if (specialize == false)
+  {
+    return "";
+  }
+  std::ostringstream options;
+  options.precision(17);
+  auto literal = [&](char const* name, double value) {
+    options << " -D " << name << "=(ehfloat)(" << value << ")";
+  };
+  const double pi = std::acos(-1.0);
+  literal("EH_H", H);
+  literal("EH_INVH", invH);
+  literal("EH_MASS", mass);
+  literal("EH_RHO0", rho0);
+  literal("EH_GAMMA", gamma);
+  literal("EH_PRESSURE0", pressure0);
+  literal("EH_MU", mu);
+  literal("EH_POLY6_NORM(invh)", 315.0 / (64.0 * pi) * std::pow(invH, 3));
+  literal("EH_POLY6_GRAD_NORM(invh)",
+          -945.0 / (32.0 * pi) * std::pow(invH, 5));
+  if (gamma > 0 && gamma <= 16 && gamma == std::floor(gamma))
+  {
+    options << " -D EH_GAMMA_INT=" << (int)gamma;
+  }
+  return options.str();
+}
+// cache file of the program for these sources and options on this device;
+// the driver version is part of the key since binaries are not portable
+std::string engine_t::program_cache_path(std::string const& source,
+                                         std::string const& options)
+{
+  std::string key = source;
+  key += '\0' + options;
+  key += '\0' + device.getInfo<CL_DEVICE_NAME>();
+  key += '\0' + device.getInfo<CL_DRIVER_VERSION>();
+  key += '\0' + platform.getInfo<CL_PLATFORM_VERSION>();
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char ch : key)
+  {
+    hash = (hash ^ ch) * 1099511628211ull;
+  }
+  std::ostringstream path;
+  path << program_cache_dir << "/" << std::hex << std::setw(16)
+       << std::setfill('0') << hash << ".bin";
+  return path.str();
+}
+bool engine_t::load_program_binary(std::string const& path,
+                                   std::string const& options)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+  {
+    return false;
+  }
+  std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)),
+                                    std::istreambuf_iterator<char>());
+  if (binary.empty())
+  {
+    return false;
+  }
+  cl_int err;
+  std::vector<cl_int> status;
+  cl::Program cached(context, { device }, cl::Program::Binaries(1, binary),
+                     &status, &err);
+  if (err != CL_SUCCESS || status[0] != CL_SUCCESS
+      || cached.build({ device }, options.c_str()) != CL_SUCCESS)
+  {
+    // stale or corrupt; rebuilt from source and overwritten
+    return false;
+  }
+  program = cached;
+  return true;
+}
+void engine_t::save_program_binary(std::string const& path)
+{
+  std::vector<std::vector<unsigned char>> binaries
+      = program.getInfo<CL_PROGRAM_BINARIES>();
+  if (binaries.empty() || binaries[0].empty())
+  {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(program_cache_dir, ec);
+  // write then rename, so a concurrent run never reads a partial file; the
+  // random suffix keeps runs building the same program off each other's
+  // temporary file
+  std::string temp = path + "." + std::to_string(std::random_device()())
+                     + ".tmp";
+  {
+    std::ofstream file(temp, std::ios::binary);
+    file.write((char const*)binaries[0].data(), binaries[0].size());
+    if (file)
+    {
+      file.close();
+      std::filesystem::rename(temp, path, ec);
+      if (!ec)
+      {
+        return;
+      }
+    }
+  }
+  std::filesystem::remove(temp, ec);
+}
+void engine_t::select_device()
+{
+  std::vector<cl::Platform> platforms;
+  std::vector<std::pair<cl::Platform, cl::Device>> candidates;
+  cl::Platform::get(&platforms);
+  for (cl::Platform& p : platforms)
+  {
+    std::vector<cl::Device> devices;
+    p.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    for (cl::Device& d : devices)
+    {
+      candidates.push_back({ p, d });
+    }
+  }
+  if (candidates.empty())
+  {
+    throw std::runtime_error("no OpenCL device found");
+  }
+  auto lower = [](std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return s;
+  };
+  auto fp64 = [](cl::Device& d) {
+    std::string extensions = d.getInfo<CL_DEVICE_EXTENSIONS>();
+    return extensions.find("cl_khr_fp64") != std::string::npos;
+  };
+  if (debug)
+  {
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+      std::cout << "[" << i << "] "
+                << candidates[i].first.getInfo<CL_PLATFORM_NAME>() << " : "
+                << candidates[i].second.getInfo<CL_DEVICE_NAME>() << "\n";
+    }
+  }
 
+  std::string want = lower(device_selector);
+  int chosen = -1;
+  auto first_of = [&](cl_device_type type, bool need_fp64) {
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+      cl::Device& d = candidates[i].second;
+      if ((d.getInfo<CL_DEVICE_TYPE>() & type) && (!need_fp64 || fp64(d)))
+      {
+        return (int)i;
+      }
+    }
+    return -1;
+  };
+  if (want.empty())
+  {
+    cl_device_type const types[]
+        = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_ALL };
+    for (cl_device_type type : types)
+    {
+      if (chosen < 0)
+      {
+        chosen = first_of(type, USE_DOUBLE == 1 || USE_MIXED == 1);
+      }
+    }
+    // fails below with the double precision error
+    chosen = chosen < 0 ? 0 : chosen;
+  }
+  else if (want == "gpu")
+  {
+    chosen = first_of(CL_DEVICE_TYPE_GPU, false);
+  }
+  else if (want == "cpu")
+  {
+    chosen = first_of(CL_DEVICE_TYPE_CPU, false);
+  }
+  else if (want == "accelerator")
+  {
+    chosen = first_of(CL_DEVICE_TYPE_ACCELERATOR, false);
+  }
+  else if (std::all_of(want.begin(), want.end(),
+                       [](unsigned char c) { return std::isdigit(c); }))
+  {
+    size_t index = std::stoul(want);
+    chosen = index < candidates.size() ? (int)index : -1;
+  }
+  else
+  {
+    for (size_t i = 0; i < candidates.size() && chosen < 0; ++i)
+    {
+      std::string name
+          = lower(candidates[i].second.getInfo<CL_DEVICE_NAME>()) + " "
+            + lower(candidates[i].first.getInfo<CL_PLATFORM_NAME>());
+      if (name.find(want) != std::string::npos)
+      {
+        chosen = (int)i;
+      }
+    }
+  }
+  if (chosen < 0)
+  {
+    throw std::runtime_error("no OpenCL device matches \"" + device_selector
+                             + "\"");
+  }
+  platform = candidates[chosen].first;
+  device = candidates[chosen].second;
+}
+void engine_t::build_program()
+{
   std::cout << SPH_OPENCL_KERNEL_FILE << "\n";
 
   // loading sources
-  std::ifstream file(SPH_OPENCL_KERNEL_FILE);
-  file.seekg(0, std::ifstream::end);
-  size_t filesize = file.tellg();
-  std::string source;
-  source.resize(filesize);
-  file.seekg(0, std::ifstream::beg);
-  file.read(&source[0], filesize);
-
-  // loading flag.h
-  file = std::ifstream(SPH_OPENCL_FLAG_FILE);
-  file.seekg(0, std::ifstream::end);
-  filesize = file.tellg();
-  std::string flagsource;
-  flagsource.resize(filesize);
-  file.seekg(0, std::ifstream::beg);
-  file.read(&flagsource[0], filesize);
+  std::string source = read_source(SPH_OPENCL_KERNEL_FILE);
+  std::string flagsource = read_source(SPH_OPENCL_FLAG_FILE);
+  std::string attributesource = read_source(SPH_OPENCL_ATTRIBUTE_FILE);
 
 #if USE_DOUBLE == 1
   std::string typedef_ehfloat = "typedef double ehfloat;\n"
@@ -130,24 +455,91 @@ void engine_t::load_opencl()
                                 "typedef float16 ehfloat16;\n";
   std::string build_options = "-cl-std=CL1.2 -D EH_PI=M_PI_F";
 #endif
+  {
+    // boundary pressure is fixed by set(), so fold it into the program
+    std::ostringstream static_pressure;
+    static_pressure.precision(17);
+    static_pressure << pressure0 * (std::pow(static_rho, gamma) - 1.0);
+    build_options += " -D EH_STATIC_PRESSURE=(ehfloat)("
+                     + static_pressure.str() + ")";
+  }
+  if (neighbor_grid)
+  {
+    build_options += " -D EH_NEIGHBOR_GRID";
+  }
+  if (iisph)
+  {
+    build_options += " -D EH_IISPH";
+  }
+  if (hashed_grid)
+  {
+    build_options += " -D EH_GRID_HASH";
+  }
+  else if (morton_grid)
+  {
+    build_options += " -D EH_GRID_MORTON";
+  }
+#if USE_MIXED == 1
+  build_options += " -D EH_MIXED";
+#endif
+#if USE_HALF == 1
+  build_options += " -D EH_HALF";
+#endif
+#if USE_SOA == 1
+  build_options += " -D EH_SOA -D EH_SOA_STRIDE="
+                   + std::to_string(max_particle_count);
+#endif
 
   cl::Program::Sources sources;
   sources.push_back({ typedef_ehfloat.c_str(), typedef_ehfloat.size() });
   sources.push_back({ flagsource.c_str(), flagsource.size() });
+  sources.push_back({ attributesource.c_str(), attributesource.size() });
   sources.push_back({ source.c_str(), source.size() });
 
-  program = cl::Program(context, sources);
-  if (program.build({ device }, build_options.c_str()) != CL_SUCCESS)
+  built_constants = specialized_constants();
+  build_options += specialization_options();
+
+  auto build_begin = std::chrono::steady_clock::now();
+  std::string cache_path;
+  if (program_cache_dir.size() > 0)
+  {
+    cache_path = program_cache_path(
+        typedef_ehfloat + flagsource + attributesource + source,
+        build_options);
+  }
+  program_cached
+      = cache_path.size() > 0 && load_program_binary(cache_path, build_options);
+  if (program_cached == false)
+  {
+    program = cl::Program(context, sources);
+    if (program.build({ device }, build_options.c_str()) != CL_SUCCESS)
+    {
+      std::cout << "error building kernel\n";
+      std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>()[0].second
+                << "\n";
+      throw std::runtime_error("program building error");
+    }
+    if (cache_path.size() > 0)
+    {
+      save_program_binary(cache_path);
+    }
+  }
+  program_build_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - build_begin)
+                         .count();
+  if (debug)
   {
-    std::cout << "error building kernel\n";
-    std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>()[0].second << "\n";
-    throw std::runtime_error("program building error");
+    std::cout << "program : "
+              << (program_cached ? "cached binary" : "built from source")
+              << ", " << program_build_ms << " ms\n";
   }
 
   kernels.assume_grid_count
       = decltype(kernels.assume_grid_count)(program, "assume_grid_count");
-  kernels.move_to_new_grid
-      = decltype(kernels.move_to_new_grid)(program, "move_to_new_grid");
+  kernels.clear_count = decltype(kernels.clear_count)(program, "clear_count");
+  kernels.reorder_particles = cl::Kernel(program, "reorder_particles");
+  kernels.finish_grid_sort
+      = decltype(kernels.finish_grid_sort)(program, "finish_grid_sort");
   kernels.calculate_nonpressure_force
       = decltype(kernels.calculate_nonpressure_force)(
           program, "calculate_nonpressure_force");
@@ -155,6 +547,15 @@ void engine_t::load_opencl()
       = decltype(kernels.calculate_pressure)(program, "calculate_pressure");
   kernels.calculate_pressure_force = decltype(kernels.calculate_pressure_force)(
       program, "calculate_pressure_force");
+  if (hashed_grid == false)
+  {
+    kernels.calculate_nonpressure_force_tiled
+        = decltype(kernels.calculate_nonpressure_force_tiled)(
+            program, "calculate_nonpressure_force_tiled");
+    kernels.calculate_pressure_force_tiled
+        = decltype(kernels.calculate_pressure_force_tiled)(
+            program, "calculate_pressure_force_tiled");
+  }
   kernels.advect_phase1
       = decltype(kernels.advect_phase1)(program, "advect_phase1");
   kernels.advect_phase2
@@ -166,13 +567,94 @@ void engine_t::load_opencl()
       program, "assume_neighbor_count");
   kernels.make_neighborlist
       = decltype(kernels.make_neighborlist)(program, "make_neighborlist");
+  kernels.make_neighborlist_fixed = decltype(kernels.make_neighborlist_fixed)(
+      program, "make_neighborlist_fixed");
+  kernels.check_displacement
+      = decltype(kernels.check_displacement)(program, "check_displacement");
 
-  kernels.prefix_sum_phase1
-      = decltype(kernels.prefix_sum_phase1)(program, "prefix_sum_phase1");
-  kernels.prefix_sum_phase2
-      = decltype(kernels.prefix_sum_phase2)(program, "prefix_sum_phase2");
+  kernels.prefix_sum_block
+      = decltype(kernels.prefix_sum_block)(program, "prefix_sum_block");
+  kernels.prefix_sum_add
+      = decltype(kernels.prefix_sum_add)(program, "prefix_sum_add");
 
-  upload_constants();
+  kernels.reduce_particles
+      = decltype(kernels.reduce_particles)(program, "reduce_particles");
+  kernels.reduce_partial
+      = decltype(kernels.reduce_partial)(program, "reduce_partial");
+  kernels.update_dt = decltype(kernels.update_dt)(program, "update_dt");
+
+  kernels.iisph_predict
+      = decltype(kernels.iisph_predict)(program, "iisph_predict");
+  kernels.iisph_setup = decltype(kernels.iisph_setup)(program, "iisph_setup");
+  kernels.iisph_pressure_accel = decltype(kernels.iisph_pressure_accel)(
+      program, "iisph_pressure_accel");
+  kernels.iisph_update_pressure = decltype(kernels.iisph_update_pressure)(
+      program, "iisph_update_pressure");
+  kernels.iisph_check = decltype(kernels.iisph_check)(program, "iisph_check");
+  kernels.iisph_finish
+      = decltype(kernels.iisph_finish)(program, "iisph_finish");
+  kernels.iisph_integrate
+      = decltype(kernels.iisph_integrate)(program, "iisph_integrate");
+  {
+    size_t max_size = std::min(
+        kernels.reduce_particles.getKernel()
+            .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+        kernels.reduce_partial.getKernel()
+            .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+    while (reduce_local_size > (int)max_size)
+    {
+      reduce_local_size >>= 1;
+    }
+  }
+
+  if (hashed_grid == false)
+  {
+    // every work-item stages one particle of each tile
+    size_t max_size = std::min(
+        kernels.calculate_nonpressure_force_tiled.getKernel()
+            .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+        kernels.calculate_pressure_force_tiled.getKernel()
+            .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+    size_t tile_bytes = 2 * sizeof(ehfloat3) + sizeof(ehfloat) + sizeof(cl_int);
+    cl_ulong local_memory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    while (tile_local_size > 1
+           && (tile_local_size > (int)max_size
+               || tile_local_size * tile_bytes > local_memory))
+    {
+      tile_local_size >>= 1;
+    }
+  }
+
+  // prefix_sum_block needs a power-of-two work-group size
+  size_t max_local_size
+      = kernels.prefix_sum_block.getKernel()
+            .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  while (prefix_sum_local_size > (int)max_local_size)
+  {
+    prefix_sum_local_size >>= 1;
+  }
+  prefix_sum_blocks.clear();
+  {
+    int block = prefix_sum_local_size * 2;
+    int n = std::max(gridcells + 1, max_particle_count + 1);
+    do
+    {
+      n = (n + block - 1) / block;
+      prefix_sum_blocks.push_back(
+          cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int)));
+    } while (n > 1);
+  }
+}
+void engine_t::update_specialization()
+{
+  if (specialize && specialized_constants() != built_constants)
+  {
+    if (debug)
+    {
+      std::cout << "rebuilding specialized program\n";
+    }
+    build_program();
+  }
 }
 void engine_t::set(param_t& param)
 {
@@ -198,7 +680,44 @@ void engine_t::set(param_t& param)
     diffusion_dt = param.diffusion_dt_factor * gap * gap / mu;
   }
   dt = std::min(courant_dt, diffusion_dt);
-  gridH = H * 1.1;
+  fixed_dt = dt;
+  adaptive_dt = param.adaptive_dt;
+  courant_dt_factor = param.courant_dt_factor;
+  force_dt_factor = param.force_dt_factor;
+  // the diffusion limit does not depend on the flow, so it caps dt directly
+  max_dt = std::min(diffusion_dt, param.max_dt_factor * dt);
+  time = 0;
+  dt_synced_step = 0;
+  iisph = param.iisph;
+  iisph_max_iterations = param.iisph_max_iterations;
+  iisph_min_iterations = param.iisph_min_iterations;
+  iisph_tolerance = param.iisph_tolerance;
+  iisph_omega = param.iisph_omega;
+  iisph_stats = {};
+  dt_history.clear();
+  sync_interval = param.sync_interval;
+  predicted_density = param.predicted_density;
+  specialize = param.specialize;
+  profiling = param.profile;
+  profile_trace = param.profile_trace;
+  device_selector = param.device;
+  local_size = param.local_size;
+  program_cache_dir = param.program_cache_dir;
+  incremental_sort = param.incremental_sort;
+  full_sort_interval = param.full_sort_interval;
+  sort_countdown = 0;
+  sort_stats = {};
+  neighbor_grid = param.neighbor_grid;
+  neighbor_stride = neighbor_grid ? 0 : param.neighbor_stride;
+  verlet_list = param.verlet_list;
+  verlet_valid = false;
+  if (incremental_sort && verlet_list)
+  {
+    // the list also holds the skin candidates, which a kept order can miss
+    throw std::runtime_error("incremental_sort cannot reuse a verlet_list");
+  }
+  skin = H * param.neighbor_skin;
+  gridH = H + skin;
   gridinvH = 1.0 / gridH;
   gravity = param.gravity;
   pressure0 = Cs * Cs * rho0 / gamma;
@@ -208,6 +727,59 @@ void engine_t::set(param_t& param)
   {
     gridsize.s[i] = (int)std::ceil((maxbound.s[i] - minbound.s[i]) * gridinvH);
   }
+  morton_grid = param.morton_grid;
+  hashed_grid = param.hashed_grid;
+  tiled_force[0] = tiled_force[1] = param.tiled_forces;
+  tune_forces = param.tune_forces;
+  force_tuning = {};
+  force_tuning.active = tune_forces;
+  if ((param.tiled_forces || tune_forces) && (verlet_list || hashed_grid))
+  {
+    throw std::runtime_error(
+        "tiled force kernels need the dense grid of the current step");
+  }
+  if (param.half_neighbors)
+  {
+    throw std::runtime_error(
+        "half_neighbors is only implemented by the native backend");
+  }
+  if (hashed_grid)
+  {
+    // memory follows the particle count, not the bounding box
+    int size = param.hash_table_size;
+    if (size <= 0)
+    {
+      size = 2 * max_particle_count;
+    }
+    gridcells = 1;
+    while (gridcells < size)
+    {
+      gridcells <<= 1;
+    }
+  }
+  else if (morton_grid)
+  {
+    // Z-order indices cover a power-of-two cube
+    int bits = 0;
+    int maxsize = std::max({ gridsize.s[0], gridsize.s[1], gridsize.s[2] });
+    while ((1 << bits) < maxsize)
+    {
+      ++bits;
+    }
+    if (bits > 10)
+    {
+      std::cout << "grid too large for morton order, using row-major\n";
+      morton_grid = false;
+    }
+    else
+    {
+      gridcells = 1 << (3 * bits);
+    }
+  }
+  if (hashed_grid == false && morton_grid == false)
+  {
+    gridcells = gridsize.s[0] * gridsize.s[1] * gridsize.s[2];
+  }
   if (debug)
   {
     std::cout << "maxparticle : " << max_particle_count << "\n";
@@ -234,128 +806,491 @@ void engine_t::log()
   std::cout << "pressure0 : " << Cs * Cs * rho0 / gamma << "\n";
   std::cout << "mass : " << mass << "\n";
 }
+// mean index distance between neighbors, a proxy for the cache hit rate of
+// the neighbor gathers
+void engine_t::log_neighbor_locality()
+{
+  if (neighbor_grid)
+  {
+    return;
+  }
+  std::vector<cl_int> begin = get_buffer<cl_int>(neighbor_count);
+  if (neighbor_stride == 0)
+  {
+    begin.resize(N + 1);
+    queue.enqueueReadBuffer(neighbor_count, CL_TRUE, sizeof(cl_int) * N,
+                            sizeof(cl_int), &begin[N], nullptr,
+                            profile_event("read neighbor_count"));
+  }
+  size_t size = neighbor_stride > 0 ? neighbors_size : begin[N];
+  std::vector<cl_int> list(size);
+  queue.enqueueReadBuffer(neighbors, CL_TRUE, 0, sizeof(cl_int) * size,
+                          list.data(), nullptr,
+                          profile_event("read neighbors"));
+
+  double distance = 0;
+  long near = 0;
+  long pairs = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    int b = neighbor_stride > 0 ? i * neighbor_stride : begin[i];
+    int e = neighbor_stride > 0 ? b + begin[i] : begin[i + 1];
+    if (neighbor_stride > 0 && begin[i] < 0)
+    {
+      // spilled list, see neighbor_range in kernels.cl
+      b = -begin[i];
+      e = b + list[b - 1];
+    }
+    for (int jj = b; jj < e; ++jj)
+    {
+      int d = std::abs(list[jj] - i);
+      distance += d;
+      // neighbors within 64 particles of i are likely already cached
+      near += d < 64;
+      ++pairs;
+    }
+  }
+  if (pairs == 0)
+  {
+    return;
+  }
+  std::cout << "neighbor index distance : " << distance / pairs << "\n";
+  std::cout << "neighbors within 64 : " << 100.0 * near / pairs << "%\n";
+}
+void engine_t::log_stats()
+{
+  if (dt_history.size() > 0)
+  {
+    ehfloat lo = *std::min_element(dt_history.begin(), dt_history.end());
+    ehfloat hi = *std::max_element(dt_history.begin(), dt_history.end());
+    double sum = 0;
+    for (ehfloat x : dt_history)
+    {
+      sum += x;
+    }
+    double mean = sum / dt_history.size();
+    std::cout << "dt min/mean/max : " << lo << " / " << mean << " / " << hi
+              << "\n";
+    std::cout << "mean dt / fixed dt : " << mean / fixed_dt << "\n";
+  }
+  if (tune_forces || tiled_force[0] || tiled_force[1])
+  {
+    char const* names[2] = { "nonpressure", "pressure" };
+    const int rounds = force_tuning_rounds;
+    for (int kernel = 0; kernel < 2; ++kernel)
+    {
+      std::cout << names[kernel] << " force kernel : "
+                << (tiled_force[kernel] ? "tiled" : "per particle");
+      if (tune_forces)
+      {
+        std::cout << " (" << force_tuning.ms[kernel][0] / rounds
+                  << " ms per particle, " << force_tuning.ms[kernel][1] / rounds
+                  << " ms tiled)";
+      }
+      std::cout << "\n";
+    }
+  }
+  if (iisph_stats.steps > 0)
+  {
+    std::cout << "iisph iterations / step : "
+              << (double)iisph_stats.total_iterations / iisph_stats.steps
+              << "\n";
+    std::cout << "iisph max density error : "
+              << 100.0 * iisph_stats.max_density_error << "%\n";
+  }
+  if (sort_stats.steps == 0)
+  {
+    return;
+  }
+  std::cout << (verlet_list ? "reused neighbor list : " : "kept cell order : ")
+            << sort_stats.skipped << " / " << sort_stats.steps << " steps ("
+            << 100.0 * sort_stats.skipped / sort_stats.steps << "%)\n";
+  std::cout << "particles in their sorted cell : "
+            << 100.0 * (sort_stats.particles - sort_stats.moved)
+                   / sort_stats.particles
+            << "%\n";
+}
 
-void engine_t::prefix_sum(cl::Buffer& buf, int size)
+void engine_t::write_vec3(cl::Buffer& buf,
+                          int offset,
+                          std::vector<ehfloat3> const& data,
+                          char const* name)
 {
-  std::vector<cl_int> B(size + 1);
-  queue.enqueueReadBuffer(buf, CL_TRUE, 0, sizeof(cl_int) * (size + 1),
-                          B.data());
-  int x = 0;
-  for (int i = 0; i <= size; ++i)
+#if USE_SOA == 1
+  std::vector<ehfloat> plane(data.size());
+  for (int d = 0; d < 3; ++d)
   {
-    int a = B[i];
-    B[i] = x;
-    x += a;
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+      plane[i] = data[i].s[d];
+    }
+    queue.enqueueWriteBuffer(
+        buf, CL_TRUE, sizeof(ehfloat) * (d * max_particle_count + offset),
+        sizeof(ehfloat) * plane.size(), plane.data(), nullptr,
+        profile_event(name));
+  }
+#else
+  queue.enqueueWriteBuffer(buf, CL_TRUE, sizeof(ehfloat3) * offset,
+                           sizeof(ehfloat3) * data.size(), data.data(),
+                           nullptr, profile_event(name));
+#endif
+}
+std::vector<ehfloat3> engine_t::read_vec3(cl::Buffer& buf)
+{
+#if USE_SOA == 1
+  std::vector<ehfloat> planes
+      = get_buffer<ehfloat>(buf, 3 * max_particle_count);
+  std::vector<ehfloat3> data(N);
+  for (int i = 0; i < N; ++i)
+  {
+    for (int d = 0; d < 3; ++d)
+    {
+      data[i].s[d] = planes[d * max_particle_count + i];
+    }
   }
-  queue.enqueueWriteBuffer(buf, CL_TRUE, 0, sizeof(cl_int) * (size + 1),
-                           B.data());
-  /*
+  return data;
+#else
+  return get_buffer<ehfloat3>(buf);
+#endif
+}
+void engine_t::sync_count()
+{
+  if (count_event() == nullptr)
+  {
+    return;
+  }
+  count_event.wait();
+  count_event = cl::Event();
+  N = count_readback;
+  uploaded_constants.N = N;
+  calculate_global_work_size();
+  if (neighbor_total > max_particle_count * MAX_NEIGHBORS)
+  {
+    throw std::runtime_error("too many neighbors...");
+  }
+}
+
+// exclusive scan of buf[0..size] in place; buf[size] becomes the total.
+// Nothing is done if gate[0] is clear.
+void engine_t::prefix_sum(cl::Buffer& buf,
+                          int size,
+                          cl::Buffer& gate,
+                          int level)
+{
+  const int n = size + 1;
+  const int local_size = prefix_sum_local_size;
+  const int groups = (n + local_size * 2 - 1) / (local_size * 2);
+  cl::Buffer& block_sum = prefix_sum_blocks[level];
+
   cl_int err;
-  kernels.prefix_sum_phase1(
-    cl::EnqueueArgs(queue,cl::NDRange(32)),
-    buf,
-    out,
-    size,
-    32,
-    err
-  ).wait();
-  check_kernel_error( err, "error prefix_sum_phase1" );
-
-  kernels.prefix_sum_phase2(
-    cl::EnqueueArgs(queue,cl::NDRange(size+1)),
-    buf,
-    out,
-    size,
-    32,
-    err
-  ).wait();
-  check_kernel_error( err, "error prefix_sum_phase2" );
-  */
+  profile(kernels.prefix_sum_block(
+              cl::EnqueueArgs(queue, cl::NDRange(groups * local_size),
+                              cl::NDRange(local_size)),
+              buf, block_sum, n, cl::Local(sizeof(cl_int) * local_size * 2),
+              gate, err),
+          "prefix_sum_block");
+  check_kernel_error(err, "error prefix_sum_block");
+  if (groups == 1)
+  {
+    return;
+  }
+
+  prefix_sum(block_sum, groups - 1, gate, level + 1);
+  profile(kernels.prefix_sum_add(
+              cl::EnqueueArgs(queue, cl::NDRange(groups * local_size),
+                              cl::NDRange(local_size)),
+              buf, block_sum, n, gate, err),
+          "prefix_sum_add");
+  check_kernel_error(err, "error prefix_sum_add");
 }
 void engine_t::grid_sort()
 {
-  cl::Event event;
-  int gs = gridsize.s[0] * gridsize.s[1] * gridsize.s[2];
-  queue.enqueueFillBuffer(grid_particlecount, cl_int(0), 0,
-                          sizeof(cl_int) * (gs + 1), 0, &event);
-  event.wait();
-
   cl_int err;
-  kernels
-      .assume_grid_count(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                         constant_buffer, grid_particlecount, grid_localindex,
-                         position, gridindex, err)
-      .wait();
+  int gs = gridcells;
+  // with incremental_sort or verlet_list, sort_state[0] tells the kernels
+  // whether to replace the order of the last sort; if not, only
+  // reorder_particles runs and copies the attributes into pong, so the
+  // buffers are swapped either way and the host never waits for the decision
+  profile(kernels.clear_count(cl::EnqueueArgs(queue, cl::NDRange(gs + 1)),
+                              grid_particlecount, gs + 1, sort_state, err),
+          "clear_count");
+  check_kernel_error(err, "error clear_count");
+
+  profile(kernels.assume_grid_count(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, grid_particlecount, grid_localindex, position,
+              gridindex, sort_state, err),
+          "assume_grid_count");
   check_kernel_error(err, "error assume_grid_count");
 
-  prefix_sum(grid_particlecount, gridsize.s[0] * gridsize.s[1] * gridsize.s[2]);
+  prefix_sum(grid_particlecount, gs, sort_state);
 
-  // type 0 : int
-  // type 1 : ehfloat
-  // type 2 : ehfloat2
-  // type 3 : ehfloat3
-  auto move_to_new_grid = [&](cl::Buffer& A, cl::Buffer& newA, int type)
+  const bool reuse = incremental_sort || verlet_list;
+  cl::Kernel& reorder = kernels.reorder_particles;
+  int arg = 0;
+  reorder.setArg(arg++, constant_buffer);
+  reorder.setArg(arg++, grid_particlecount);
+  reorder.setArg(arg++, grid_localindex);
+#define EH_ATTRIBUTE_ARG(name, type) \
+  reorder.setArg(arg++, name);       \
+  reorder.setArg(arg++, pong.name);
+  EH_PARTICLE_ATTRIBUTES(EH_ATTRIBUTE_ARG)
+  if (iisph)
   {
-    cl_int err;
-    kernels.move_to_new_grid(
-        cl::EnqueueArgs(queue, cl::NDRange(global_work_size)), constant_buffer,
-        grid_particlecount, grid_localindex, gridindex, A, newA, type, err);
-    check_kernel_error(err, "error move_to_new_grid");
-    std::swap(A, newA);
-  };
-  move_to_new_grid(position, float3_pong, 3);
-  move_to_new_grid(velocity, float3_pong, 3);
-  move_to_new_grid(svelocity, float3_pong, 3);
-  move_to_new_grid(flags, int_pong, 0);
-  move_to_new_grid(color, int_pong, 0);
-
-  queue.enqueueReadBuffer(grid_particlecount, CL_TRUE, sizeof(cl_int) * gs,
-                          sizeof(cl_int), &N);
+    EH_IISPH_ATTRIBUTES(EH_ATTRIBUTE_ARG)
+  }
+#undef EH_ATTRIBUTE_ARG
+  reorder.setArg(arg++, gridindex);
+  reorder.setArg(arg++, cellindex);
+  reorder.setArg(arg++, build_position);
+  reorder.setArg(arg++, sort_state);
+  reorder.setArg(arg++, cl_int(reuse ? 1 : 0));
+  err = queue.enqueueNDRangeKernel(
+      reorder, cl::NullRange, cl::NDRange(global_work_size), cl::NullRange,
+      nullptr, profile_event("reorder_particles"));
+  check_kernel_error(err, "error reorder_particles");
+#define EH_ATTRIBUTE_SWAP(name, type) std::swap(name, pong.name);
+  EH_PARTICLE_ATTRIBUTES(EH_ATTRIBUTE_SWAP)
+  if (iisph)
+  {
+    EH_IISPH_ATTRIBUTES(EH_ATTRIBUTE_SWAP)
+  }
+#undef EH_ATTRIBUTE_SWAP
 
-  upload_constants();
-  calculate_global_work_size();
-  queue.flush();
-  queue.finish();
+  // particles in the overflow cell are dropped; the new N stays on the device
+  // and is read back to the host without blocking
+  queue.enqueueCopyBuffer(grid_particlecount, constant_buffer,
+                          sizeof(cl_int) * gs, offsetof(constant_t, N),
+                          sizeof(cl_int), nullptr,
+                          profile_event("copy grid_particlecount"));
+  queue.enqueueReadBuffer(grid_particlecount, CL_FALSE, sizeof(cl_int) * gs,
+                          sizeof(cl_int), &count_readback, nullptr,
+                          &count_event);
+  profile(count_event, "read grid_particlecount");
 }
 void engine_t::make_neighbors()
 {
+  if (neighbor_grid)
+  {
+    return;
+  }
+  if (neighbor_stride > 0)
+  {
+    make_neighbors_fixed();
+    return;
+  }
+
+  // N on the host may still be the pre-sort count, so clear the tail to keep
+  // the scanned total at neighbor_count[N] exact
   cl_int err;
-  kernels
-      .assume_neighbor_count(
-          cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-          constant_buffer, grid_particlecount, position, flags, neighbor_count,
-          err)
-      .wait();
+  profile(kernels.clear_count(cl::EnqueueArgs(queue, cl::NDRange(N + 1)),
+                              neighbor_count, N + 1, neighbor_gate(), err),
+          "clear_count");
+  check_kernel_error(err, "error clear_count");
+
+  profile(kernels.assume_neighbor_count(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, grid_particlecount, position, flags,
+              neighbor_count, neighbor_gate(), err),
+          "assume_neighbor_count");
   check_kernel_error(err, "error assume_neighbor_count");
 
-  prefix_sum(neighbor_count, N);
-  cl_int MN;
-  queue.enqueueReadBuffer(neighbor_count, CL_TRUE, sizeof(cl_int) * N,
-                          sizeof(cl_int), &MN);
-  // std::cout << MN << "\n";
-  if (MN > max_particle_count * MAX_NEIGHBORS)
+  prefix_sum(neighbor_count, N, neighbor_gate());
+  queue.enqueueReadBuffer(neighbor_count, CL_FALSE, sizeof(cl_int) * N,
+                          sizeof(cl_int), &neighbor_total, nullptr,
+                          &count_event);
+  profile(count_event, "read neighbor_count");
+
+  profile(kernels.make_neighborlist(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, grid_particlecount, position, flags,
+              neighbor_count, neighbors, max_particle_count * MAX_NEIGHBORS,
+              neighbor_gate(), err),
+          "make_neighborlist");
+  check_kernel_error(err, "error make_neighborlist");
+}
+void engine_t::make_neighbors_fixed()
+{
+  // the spill is taken from the start by every build
+  queue.enqueueFillBuffer(neighbor_overflow, cl_int(0), sizeof(cl_int),
+                          sizeof(cl_int), nullptr,
+                          profile_event("fill neighbor_overflow"));
+  const cl_int spill_begin = (cl_int)(neighbors_size - spill_size);
+  cl_int err;
+  profile(kernels.make_neighborlist_fixed(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, grid_particlecount, position, flags,
+              neighbor_count, neighbors, neighbor_overflow, spill_begin,
+              (cl_int)neighbors_size, neighbor_gate(), err),
+          "make_neighborlist_fixed");
+  check_kernel_error(err, "error make_neighborlist_fixed");
+  if (overflow_event() != nullptr)
   {
-    throw std::runtime_error("too many neighbors...");
+    // the kernel adds to the values the pending readback will not see
+    return;
+  }
+  queue.enqueueReadBuffer(neighbor_overflow, CL_FALSE, 0,
+                          sizeof(overflow_readback), overflow_readback,
+                          nullptr, &overflow_event);
+  profile(overflow_event, "read neighbor_overflow");
+  queue.enqueueFillBuffer(neighbor_overflow, cl_int(0), 0,
+                          3 * sizeof(cl_int), nullptr,
+                          profile_event("fill neighbor_overflow"));
+}
+void engine_t::check_neighbor_overflow(bool wait)
+{
+  if (overflow_event() == nullptr
+      || (wait == false
+          && overflow_event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>()
+                 != CL_COMPLETE))
+  {
+    return;
+  }
+  overflow_event.wait();
+  overflow_event = cl::Event();
+  const cl_int max_count = overflow_readback[0];
+  const size_t spill_demand = overflow_readback[2];
+  if (max_count <= neighbor_stride && spill_demand <= spill_size)
+  {
+    return;
   }
 
-  kernels
-      .make_neighborlist(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                         constant_buffer, grid_particlecount, position, flags,
-                         neighbor_count, neighbors, err)
-      .wait();
-  check_kernel_error(err, "error make_neighborlist");
+  // the crowded particles were served from the spill; move them back into
+  // their slots with some headroom, and keep a spill that fits the demand.
+  // A kept verlet_list does not match the new layout.
+  verlet_valid = false;
+  if (max_count > neighbor_stride)
+  {
+    neighbor_stride = max_count + max_count / 4;
+    upload_constants();
+  }
+  size_t slots = (size_t)max_particle_count * neighbor_stride;
+  spill_size = std::max({ spill_size, slots / 2, 2 * spill_demand });
+  if (debug)
+  {
+    std::cout << "neighbor_stride grown to " << neighbor_stride
+              << ", spill to " << spill_size << "\n";
+  }
+  if (slots + spill_size > neighbors_size)
+  {
+    neighbors_size = slots + spill_size;
+    neighbors = cl::Buffer(context, CL_MEM_READ_WRITE,
+                           neighbors_size * sizeof(cl_int));
+  }
+  else
+  {
+    spill_size = neighbors_size - slots;
+  }
+}
+void engine_t::update_neighbors()
+{
+  if (neighbor_stride > 0)
+  {
+    check_neighbor_overflow(false);
+  }
+  if (incremental_sort || verlet_list)
+  {
+    // keep the order of the last sort, and the verlet_list built with it,
+    // while every particle is within half the skin of its position at that
+    // sort; the 27-cell search around the current cell then still finds
+    // every neighbor in the sorted cells, and the list every neighbor
+    // within h. The gated kernels read the decision on the device.
+    cl_int2 state;
+    state.s[0] = (incremental_sort && sort_countdown <= 0)
+                 || (verlet_list && verlet_valid == false);
+    state.s[1] = 0;
+    if (incremental_sort)
+    {
+      sort_countdown
+          = state.s[0] ? full_sort_interval - 1 : sort_countdown - 1;
+    }
+    verlet_valid = true;
+    queue.enqueueFillBuffer(sort_state, state, 0, sizeof(state), nullptr,
+                            profile_event("fill sort_state"));
+    cl_int err;
+    profile(kernels.check_displacement(
+                cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+                constant_buffer, position, build_position, cellindex,
+                sort_state, (ehfloat)(0.5 * skin), err),
+            "check_displacement");
+    check_kernel_error(err, "error check_displacement");
+  }
+
+  grid_sort();
+  make_neighbors();
+  if (incremental_sort || verlet_list)
+  {
+    cl_int err;
+    profile(kernels.finish_grid_sort(cl::EnqueueArgs(queue, cl::NDRange(1)),
+                                     constant_buffer, sort_state,
+                                     sort_stats_buffer, err),
+            "finish_grid_sort");
+    check_kernel_error(err, "error finish_grid_sort");
+  }
 }
 void engine_t::calculate_rho()
 {
   cl_int err;
-  kernels
-      .calculate_rho(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                     constant_buffer,
-                     // grid_particlecount,
-                     neighbor_count, neighbors, position, rho, V, flags, err)
-      .wait();
+  profile(kernels.calculate_rho(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, neighbor_begin(), neighbors, position, velocity,
+              rho, drho, V, flags, err),
+          "calculate_rho");
   check_kernel_error(err, "error calculate_rho");
 }
+void engine_t::reduce(cl::Buffer& buf,
+                      int op,
+                      int element,
+                      int exclude_flags,
+                      cl::Buffer& result,
+                      int offset)
+{
+  cl_int err;
+  profile(kernels.reduce_particles(
+              cl::EnqueueArgs(queue,
+                              cl::NDRange(reduce_groups * reduce_local_size),
+                              cl::NDRange(reduce_local_size)),
+              constant_buffer, buf, flags, exclude_flags, op, element,
+              reduce_partial, cl::Local(sizeof(ehfloat) * reduce_local_size),
+              err),
+          "reduce_particles");
+  check_kernel_error(err, "error reduce_particles");
+  profile(kernels.reduce_partial(
+              cl::EnqueueArgs(queue, cl::NDRange(reduce_local_size),
+                              cl::NDRange(reduce_local_size)),
+              reduce_partial, reduce_groups, op, result, offset,
+              cl::Local(sizeof(ehfloat) * reduce_local_size), err),
+          "reduce_partial");
+  check_kernel_error(err, "error reduce_partial");
+}
+ehfloat engine_t::reduce(cl::Buffer& buf,
+                         int op,
+                         int element,
+                         int exclude_flags)
+{
+  ehfloat x;
+  reduce(buf, op, element, exclude_flags, reduce_result, 0);
+  queue.enqueueReadBuffer(reduce_result, CL_TRUE, 0, sizeof(ehfloat), &x,
+                          nullptr, profile_event("read reduce_result"));
+  return x;
+}
+ehfloat engine_t::max_velocity()
+{
+  return reduce(velocity, EH_REDUCE_MAX, EH_REDUCE_LENGTH, EH_PARTICLE_STATIC);
+}
+ehfloat engine_t::kinetic_energy()
+{
+  return 0.5 * mass
+         * reduce(velocity, EH_REDUCE_SUM, EH_REDUCE_LENGTH_SQ,
+                  EH_PARTICLE_STATIC);
+}
+// largest relative compression (rho - rho0) / rho0 of the fluid
+ehfloat engine_t::max_density_error()
+{
+  return reduce(rho, EH_REDUCE_MAX, EH_REDUCE_SCALAR, EH_PARTICLE_STATIC)
+             / rho0
+         - 1.0;
+}
 void engine_t::calculate_mass()
 {
   add_waitlist();
@@ -368,89 +1303,439 @@ void engine_t::calculate_mass()
   make_neighbors();
   calculate_rho();
 
-  std::vector<ehfloat> rr(N);
-  std::vector<int> ff(N);
-  queue.enqueueReadBuffer(rho, CL_TRUE, 0, sizeof(ehfloat) * N, rr.data());
-  queue.enqueueReadBuffer(flags, CL_TRUE, 0, sizeof(cl_int) * N, ff.data());
-  ehfloat maxrho = 0;
-  for (int i = 0; i < N; ++i)
-  {
-    if (ff[i] & EH_PARTICLE_STATIC)
-    {
-      continue;
-    }
-    maxrho = std::max(rr[i], maxrho);
-  }
+  ehfloat maxrho
+      = reduce(rho, EH_REDUCE_MAX, EH_REDUCE_SCALAR, EH_PARTICLE_STATIC);
   mass *= rho0 / maxrho;
   std::cout << "Mass : " << mass << "\n";
+  update_specialization();
 }
 void engine_t::calculate_pressure()
 {
   cl_int err;
-  kernels
-      .calculate_pressure(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                          constant_buffer, rho, flags, pressure, err)
-      .wait();
+  profile(kernels.calculate_pressure(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, rho, flags, pressure_rho2, err),
+          "calculate_pressure");
   check_kernel_error(err, "error calculate_pressure");
 }
 void engine_t::calculate_pressure_force()
 {
-  cl_int err;
-  kernels
-      .calculate_pressure_force(
-          cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-          constant_buffer, neighbor_count, neighbors, position, rho, pressure,
-          flags, pressure_force, V, err)
-      .wait();
-  check_kernel_error(err, "error calculate_pressure_force");
+  launch_force_kernel(1, [&](bool tiled) {
+    cl_int err;
+    if (tiled)
+    {
+      // one work-group per cell
+      const int L = tile_local_size;
+      profile(kernels.calculate_pressure_force_tiled(
+                  cl::EnqueueArgs(queue, cl::NDRange((size_t)gridcells * L),
+                                  cl::NDRange(L)),
+                  constant_buffer, grid_particlecount, position, rho,
+                  pressure_rho2, flags, pressure_force,
+                  cl::Local(sizeof(ehfloat3) * L),
+                  cl::Local(sizeof(ehfloat) * L),
+                  cl::Local(sizeof(cl_int) * L), err),
+              "calculate_pressure_force_tiled");
+      check_kernel_error(err, "error calculate_pressure_force_tiled");
+      return;
+    }
+    profile(kernels.calculate_pressure_force(
+                cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+                constant_buffer, neighbor_begin(), neighbors, position, rho,
+                pressure_rho2, flags, pressure_force, V, err),
+            "calculate_pressure_force");
+    check_kernel_error(err, "error calculate_pressure_force");
+  });
+}
+void engine_t::launch_force_kernel(int kernel,
+                                   std::function<void(bool)> const& launch)
+{
+  if (force_tuning.active == false)
+  {
+    launch(tiled_force[kernel]);
+    return;
+  }
+  // even rounds time the per-particle variant, odd rounds the tiled one
+  const bool tiled = force_tuning.rounds % 2 == 1;
+  queue.finish();
+  auto begin = std::chrono::steady_clock::now();
+  launch(tiled);
+  queue.finish();
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - begin)
+                  .count();
+  if (force_tuning.rounds >= 2)
+  {
+    force_tuning.ms[kernel][tiled] += ms;
+  }
+}
+void engine_t::finish_force_tuning()
+{
+  if (++force_tuning.rounds < 2 * (force_tuning_rounds + 1))
+  {
+    return;
+  }
+  force_tuning.active = false;
+  for (int kernel = 0; kernel < 2; ++kernel)
+  {
+    // a kernel that never ran, like the pressure force under iisph, keeps
+    // the per-particle variant
+    tiled_force[kernel]
+        = force_tuning.ms[kernel][1] < force_tuning.ms[kernel][0];
+  }
 }
 void engine_t::advect_phase1()
 {
   cl_int err;
-  kernels
-      .advect_phase1(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                     constant_buffer, flags, svelocity, position, velocity, rho,
-                     nonpressure_force, err)
-      .wait();
+  profile(kernels.advect_phase1(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, flags, svelocity, position, velocity, rho, drho,
+              pressure_rho2, nonpressure_force, err),
+          "advect_phase1");
   check_kernel_error(err, "error advect_phase1");
 }
 void engine_t::advect_phase2()
 {
   cl_int err;
-  kernels
-      .advect_phase2(cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-                     constant_buffer, flags, svelocity,
-
-                     position, velocity, rho, pressure_force, err)
-      .wait();
+  profile(kernels.advect_phase2(
+              cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+              constant_buffer, flags, svelocity, position, velocity, rho,
+              pressure_force, nonpressure_force, err),
+          "advect_phase2");
   check_kernel_error(err, "error advect_phase2");
 }
 void engine_t::calculate_nonpressure_force()
+{
+  launch_force_kernel(0, [&](bool tiled) {
+    cl_int err;
+    if (tiled)
+    {
+      // one work-group per cell
+      const int L = tile_local_size;
+      profile(kernels.calculate_nonpressure_force_tiled(
+                  cl::EnqueueArgs(queue, cl::NDRange((size_t)gridcells * L),
+                                  cl::NDRange(L)),
+                  constant_buffer, grid_particlecount, position, rho, velocity,
+                  flags, nonpressure_force, V, cl::Local(sizeof(ehfloat3) * L),
+                  cl::Local(sizeof(ehfloat3) * L),
+                  cl::Local(sizeof(ehfloat) * L),
+                  cl::Local(sizeof(cl_int) * L), err),
+              "calculate_nonpressure_force_tiled");
+      check_kernel_error(err, "error calculate_nonpressure_force_tiled");
+      return;
+    }
+    profile(kernels.calculate_nonpressure_force(
+                cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
+                constant_buffer, neighbor_begin(), neighbors, position, rho,
+                velocity, flags, nonpressure_force, V, err),
+            "calculate_nonpressure_force");
+    check_kernel_error(err, "error calculate_nonpressure_force");
+  });
+}
+void engine_t::iisph_solve()
 {
   cl_int err;
-  kernels
-      .calculate_nonpressure_force(
-          cl::EnqueueArgs(queue, cl::NDRange(global_work_size)),
-          constant_buffer, neighbor_count, neighbors, position, rho, velocity,
-          flags, nonpressure_force, V, err)
-      .wait();
-  check_kernel_error(err, "error calculate_nonpressure_force");
+  cl::EnqueueArgs args(queue, cl::NDRange(global_work_size));
+  profile(kernels.iisph_predict(
+              args, constant_buffer, flags, velocity, rho, nonpressure_force,
+              err),
+          "iisph_predict");
+  check_kernel_error(err, "error iisph_predict");
+  profile(kernels.iisph_setup(
+              args, constant_buffer, neighbor_begin(), neighbors, position,
+              velocity, rho, flags, pressure, iisph_aii, iisph_source, err),
+          "iisph_setup");
+  check_kernel_error(err, "error iisph_setup");
+
+  // clear the iteration count and converged flag, count the fluid
+  queue.enqueueFillBuffer(iisph_state, ehfloat(0), 2 * sizeof(ehfloat),
+                          2 * sizeof(ehfloat), nullptr,
+                          profile_event("fill iisph_state"));
+  reduce(rho, EH_REDUCE_SUM, EH_REDUCE_COUNT, EH_PARTICLE_STATIC, iisph_state,
+         0);
+
+  // all iterations are enqueued up front; once converged they return early,
+  // so the host never waits inside the loop
+  for (int i = 0; i < iisph_max_iterations; ++i)
+  {
+    profile(kernels.iisph_pressure_accel(
+                args, constant_buffer, neighbor_begin(), neighbors, position,
+                rho, pressure, flags, pressure_force, iisph_state, 1, err),
+            "iisph_pressure_accel");
+    check_kernel_error(err, "error iisph_pressure_accel");
+    profile(kernels.iisph_update_pressure(
+                args, constant_buffer, neighbor_begin(), neighbors, position,
+                flags, pressure_force, iisph_aii, iisph_source, pressure,
+                iisph_error, iisph_state, iisph_omega, err),
+            "iisph_update_pressure");
+    check_kernel_error(err, "error iisph_update_pressure");
+    reduce(iisph_error, EH_REDUCE_SUM, EH_REDUCE_SCALAR, EH_PARTICLE_STATIC,
+           iisph_state, 1);
+    profile(kernels.iisph_check(
+                cl::EnqueueArgs(queue, cl::NDRange(1)), iisph_state,
+                iisph_tolerance, iisph_min_iterations, err),
+            "iisph_check");
+    check_kernel_error(err, "error iisph_check");
+  }
+  profile(kernels.iisph_finish(
+              cl::EnqueueArgs(queue, cl::NDRange(1)), iisph_state, err),
+          "iisph_finish");
+  check_kernel_error(err, "error iisph_finish");
+
+  profile(kernels.iisph_pressure_accel(
+              args, constant_buffer, neighbor_begin(), neighbors, position, rho,
+              pressure, flags, pressure_force, iisph_state, 0, err),
+          "iisph_pressure_accel");
+  check_kernel_error(err, "error iisph_pressure_accel");
+  profile(kernels.iisph_integrate(
+              args, constant_buffer, flags, position, velocity, pressure_force,
+              nonpressure_force, err),
+          "iisph_integrate");
+  check_kernel_error(err, "error iisph_integrate");
+}
+void engine_t::update_dt()
+{
+  // advect_phase1/2 leave the acceleration of the step in nonpressure_force
+  reduce(velocity, EH_REDUCE_MAX, EH_REDUCE_LENGTH, EH_PARTICLE_STATIC,
+         reduce_result, 0);
+  reduce(nonpressure_force, EH_REDUCE_MAX,
+         USE_HALF == 1 ? EH_REDUCE_HALF_LENGTH : EH_REDUCE_LENGTH,
+         EH_PARTICLE_STATIC, reduce_result, 1);
+  cl_int err;
+  profile(kernels.update_dt(
+              cl::EnqueueArgs(queue, cl::NDRange(1)), constant_buffer,
+              reduce_result, dt_state, dt_ring, step_count % dt_ring_size,
+              courant_dt_factor, force_dt_factor, iisph ? 0 : Cs, max_dt, err),
+          "update_dt");
+  check_kernel_error(err, "error update_dt");
+  queue.enqueueCopyBuffer(dt_state, constant_buffer, 0,
+                          offsetof(constant_t, dt), sizeof(ehfloat), nullptr,
+                          profile_event("copy dt_state"));
+}
+void engine_t::collect_profile()
+{
+  for (auto& pending : profile_pending)
+  {
+    cl::Event& event = pending.second;
+    if (event() == nullptr)
+    {
+      continue;
+    }
+    profile_record_t record;
+    record.name = pending.first;
+    record.queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+    record.submit = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+    record.start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    record.end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    profile_stat_t& stat = profile_stats[record.name];
+    stat.durations.push_back((record.end - record.start) * 1e-6);
+    stat.wait += (record.start - record.queued) * 1e-6;
+    if (profile_trace.size() > 0)
+    {
+      profile_records.push_back(record);
+    }
+  }
+  profile_pending.clear();
+}
+std::map<std::string, double> engine_t::profile_totals()
+{
+  queue.finish();
+  collect_profile();
+  std::map<std::string, double> totals;
+  for (auto& it : profile_stats)
+  {
+    for (double d : it.second.durations)
+    {
+      totals[it.first] += d;
+    }
+  }
+  return totals;
+}
+void engine_t::log_profile()
+{
+  if (profiling == false)
+  {
+    return;
+  }
+  queue.finish();
+  collect_profile();
+
+  // sorted by total time
+  std::vector<std::pair<double, std::string>> order;
+  for (auto& it : profile_stats)
+  {
+    std::vector<double>& d = it.second.durations;
+    std::sort(d.begin(), d.end());
+    double total = 0;
+    for (double x : d)
+    {
+      total += x;
+    }
+    order.push_back({ total, it.first });
+  }
+  std::sort(order.rbegin(), order.rend());
+
+  std::cout << std::left << std::setw(28) << "kernel" << std::right
+            << std::setw(8) << "count" << std::setw(12) << "total ms"
+            << std::setw(10) << "mean us" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p99 us" << std::setw(10) << "wait us"
+            << "\n";
+  for (auto& it : order)
+  {
+    profile_stat_t& stat = profile_stats[it.second];
+    std::vector<double>& d = stat.durations;
+    size_t n = d.size();
+    std::cout << std::left << std::setw(28) << it.second << std::right
+              << std::fixed << std::setprecision(1) << std::setw(8) << n
+              << std::setw(12) << it.first << std::setw(10)
+              << 1000.0 * it.first / n << std::setw(10) << 1000.0 * d[n / 2]
+              << std::setw(10) << 1000.0 * d[std::min(n - 1, n * 99 / 100)]
+              << std::setw(10) << 1000.0 * stat.wait / n << "\n";
+  }
+  std::cout.unsetf(std::ios::floatfield);
+  std::cout << std::setprecision(6);
+
+  if (profile_trace.empty() || profile_records.empty())
+  {
+    return;
+  }
+  // chrome://tracing or Perfetto; timestamps in microseconds
+  std::ofstream trace(profile_trace);
+  cl_ulong origin = profile_records[0].queued;
+  for (profile_record_t& r : profile_records)
+  {
+    origin = std::min(origin, r.queued);
+  }
+  trace << "{\"traceEvents\":[\n";
+  for (size_t i = 0; i < profile_records.size(); ++i)
+  {
+    profile_record_t& r = profile_records[i];
+    trace << (i ? ",\n" : "") << "{\"name\":\"" << r.name
+          << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":"
+          << (r.start - origin) * 1e-3
+          << ",\"dur\":" << (r.end - r.start) * 1e-3
+          << ",\"args\":{\"queued\":" << (r.queued - origin) * 1e-3
+          << ",\"submit\":" << (r.submit - origin) * 1e-3 << "}}";
+  }
+  trace << "\n]}\n";
+  std::cout << "profile trace written to " << profile_trace << "\n";
+}
+void engine_t::sync()
+{
+  queue.finish();
+  sync_count();
+  if (neighbor_stride > 0)
+  {
+    check_neighbor_overflow(true);
+  }
+  if (profiling)
+  {
+    collect_profile();
+  }
+  if (incremental_sort || verlet_list)
+  {
+    cl_long stats[4];
+    queue.enqueueReadBuffer(sort_stats_buffer, CL_TRUE, 0, sizeof(stats),
+                            stats, nullptr, profile_event("read sort_stats"));
+    sort_stats.steps = stats[0];
+    sort_stats.skipped = stats[1];
+    sort_stats.particles = stats[2];
+    sort_stats.moved = stats[3];
+  }
+  if (iisph)
+  {
+    ehfloat state[8];
+    queue.enqueueReadBuffer(iisph_state, CL_TRUE, 0, sizeof(state), state,
+                            nullptr, profile_event("read iisph_state"));
+    long steps = (long)state[5] - iisph_stats.steps;
+    if (steps > 0)
+    {
+      iisph_stats.iterations
+          = (state[4] - iisph_stats.total_iterations) / steps;
+    }
+    iisph_stats.total_iterations = (long)state[4];
+    iisph_stats.steps = (long)state[5];
+    iisph_stats.max_density_error = state[6];
+    iisph_stats.density_error = state[7];
+  }
+  if (adaptive_dt == false)
+  {
+    return;
+  }
+
+  ehfloat state[2];
+  queue.enqueueReadBuffer(dt_state, CL_TRUE, 0, sizeof(state), state, nullptr,
+                          profile_event("read dt_state"));
+  dt = state[0];
+  uploaded_constants.dt = dt;
+  time = state[1];
+
+  // steps older than the ring were overwritten
+  int begin = std::max(dt_synced_step, step_count - dt_ring_size);
+  size_t offset = dt_history.size();
+  dt_history.resize(offset + step_count - begin);
+  for (int i = begin; i < step_count;)
+  {
+    int slot = i % dt_ring_size;
+    int n = std::min(step_count - i, dt_ring_size - slot);
+    queue.enqueueReadBuffer(dt_ring, CL_TRUE, sizeof(ehfloat) * slot,
+                            sizeof(ehfloat) * n, &dt_history[offset], nullptr,
+                            profile_event("read dt_ring"));
+    offset += n;
+    i += n;
+  }
+  dt_synced_step = step_count;
 }
 void engine_t::step()
 {
   add_waitlist();
-  calculate_global_work_size();
-  upload_constants();
-  queue.flush();
-  queue.finish();
+  update_specialization();
+  if (std::memcmp(&constants, &uploaded_constants, sizeof(constant_t)) != 0)
+  {
+    upload_constants();
+  }
 
-  grid_sort();
-  make_neighbors();
+  update_neighbors();
   calculate_rho();
   calculate_nonpressure_force();
-  advect_phase1();
-  calculate_rho();
-  calculate_pressure();
-  calculate_pressure_force();
-  advect_phase2();
+  if (iisph)
+  {
+    iisph_solve();
+  }
+  else
+  {
+    advect_phase1();
+    if (predicted_density == false)
+    {
+      calculate_rho();
+      calculate_pressure();
+    }
+    calculate_pressure_force();
+    advect_phase2();
+  }
+  if (force_tuning.active)
+  {
+    finish_force_tuning();
+  }
+  if (adaptive_dt)
+  {
+    update_dt();
+  }
+  else
+  {
+    time += dt;
+  }
+  queue.flush();
+
+  ++step_count;
+  if (sync_interval > 0 && step_count % sync_interval == 0)
+  {
+    sync();
+  }
+}
+void engine_t::run(int steps)
+{
+  for (int i = 0; i < steps; ++i)
+  {
+    step();
+  }
 }
@@ -1,19 +1,44 @@
 #pragma once
 // #include "mymath.hpp"
+#include "attributes.h"
 #include "flags.h"
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <string>
 #include <vector>
 
 #define CL_HPP_TARGET_OPENCL_VERSION 120
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
 
+// ehfloat precision; define USE_DOUBLE=0 for devices without cl_khr_fp64,
+// or USE_MIXED=1 to store float but accumulate density and pressure force
+// sums in double (ehacc), which still needs cl_khr_fp64
+#ifndef USE_MIXED
+  #define USE_MIXED 0
+#endif
+#if USE_MIXED == 1
+  #ifndef USE_DOUBLE
+    #define USE_DOUBLE 0
+  #endif
+  #if USE_DOUBLE == 1
+    #error "USE_MIXED=1 stores float; it cannot be combined with USE_DOUBLE=1"
+  #endif
+#endif
 #if defined(__APPLE__) || defined(__MACOSX)
   #include "opencl.hpp"
-  #define USE_DOUBLE 0
+  #ifndef USE_DOUBLE
+    #define USE_DOUBLE 0
+  #endif
 #else
   #include <CL/cl2.hpp>
-  #define USE_DOUBLE 1
+  #ifndef USE_DOUBLE
+    #define USE_DOUBLE 1
+  #endif
 #endif
 
 #if USE_DOUBLE == 1
@@ -27,6 +52,43 @@ using ehfloat2 = cl_float2;
 using ehfloat3 = cl_float3;
 using ehfloat4 = cl_float4;
 #endif
+#if USE_MIXED == 1
+using ehacc = cl_double;
+#else
+using ehacc = ehfloat;
+#endif
+
+// layout of the per-particle vector buffers (ehvec3 in kernels.cl); define
+// USE_SOA=1 for x, y and z planes instead of padded ehfloat3 elements
+#ifndef USE_SOA
+  #define USE_SOA 0
+#endif
+#if USE_SOA == 1
+// one element's share of the three planes; only its size is used
+struct ehvec3
+{
+  ehfloat s[3];
+};
+#else
+using ehvec3 = ehfloat3;
+#endif
+
+// storage of V, p / rho^2 and the nonpressure force (ehhalf in kernels.cl);
+// define USE_HALF=1 to keep them as half precision
+#ifndef USE_HALF
+  #define USE_HALF 0
+#endif
+#if USE_HALF == 1
+using ehhalf = cl_half;
+// one element of a packed half3 buffer; only its size is used
+struct ehhalf3
+{
+  cl_half s[3];
+};
+#else
+using ehhalf = ehfloat;
+using ehhalf3 = ehvec3;
+#endif
 
 // Engine Initialization Parameters
 struct param_t
@@ -62,7 +124,125 @@ struct param_t
   ehfloat courant_dt_factor = 0.2;
   ehfloat diffusion_dt_factor = 0.2;
 
+  // choose dt every step on the device from the largest speed and
+  // acceleration; force_dt_factor * sqrt(gap / amax) bounds the acceleration
+  // part and dt never exceeds max_dt_factor times the fixed dt
+  bool adaptive_dt = false;
+  ehfloat force_dt_factor = 0.25;
+  ehfloat max_dt_factor = 4;
+
+  // implicit incompressible SPH (IISPH) pressure solve instead of the Tait
+  // equation of state. The relaxed Jacobi iteration runs on the device until
+  // the mean density error of the fluid is below iisph_tolerance (relative
+  // to rho0). Cs then no longer limits an adaptive dt, so pair it with
+  // adaptive_dt and a larger max_dt_factor.
+  bool iisph = false;
+  int iisph_max_iterations = 50;
+  int iisph_min_iterations = 2;
+  ehfloat iisph_tolerance = 0.001;
+  ehfloat iisph_omega = 0.5;
+
   ehfloat3 gravity = { 0, 0 };
+
+  // order cells, and so the sorted particles, along a Z-order (Morton) curve
+  // instead of row-major. The curve covers a power-of-two cube; beyond 1024
+  // cells per axis, or when the cube's cell counts exceed the device's
+  // CL_DEVICE_MAX_MEM_ALLOC_SIZE, the engine falls back to row-major
+  bool morton_grid = false;
+
+  // hash cells into a fixed-size table instead of allocating the dense
+  // minbound..maxbound grid; particles are no longer clipped to the bound
+  bool hashed_grid = false;
+  // power of two; 0 : at least twice max_particle_count
+  int hash_table_size = 0;
+
+  // walk the grid cells in the force kernels instead of building a neighbor
+  // list; neighbor_stride is ignored
+  bool neighbor_grid = false;
+
+  // compute the nonpressure and pressure forces with one work-group per grid
+  // cell that stages the 27 surrounding cells in local memory, instead of
+  // one work-item per particle gathering its own neighbors. Needs the dense
+  // grid of the current step: not with verlet_list or hashed_grid.
+  bool tiled_forces = false;
+  // time both variants of each force kernel over the first steps and keep
+  // the faster one; overrides tiled_forces
+  bool tune_forces = false;
+
+  // evaluate each particle pair once and apply it to both particles.
+  // native_engine_t stores only the j > i half of the neighbor list and
+  // processes the cells in 27 colors so that no two threads write to the
+  // same particle. Only native_engine_t implements it; engine_t rejects it
+  // in set().
+  bool half_neighbors = false;
+
+  // 0 : compact neighbor list built by a counting pass and a prefix sum
+  // >0 : single-pass list with this many slots per particle. A particle
+  //      with more neighbors rebuilds its full list in a spill region in
+  //      the same launch; the overflow is read back without waiting and
+  //      grows the stride (and the spill) for the builds after it. Lists
+  //      are only cut short if more overflow in one build than the spill,
+  //      half the slot memory, holds.
+  int neighbor_stride = 0;
+
+  // neighbors are searched within h*(1+neighbor_skin)
+  ehfloat neighbor_skin = 0.1;
+  // reuse the neighbor list until a particle moved more than half the skin;
+  // decided on the device like incremental_sort, and counted in the same
+  // statistics, which sync() reads
+  bool verlet_list = false;
+
+  // keep the cell order of the last grid_sort while no particle has moved
+  // more than half the neighbor skin since; the 27-cell neighbor search is
+  // still exact then. The device decides in check_displacement, so the host
+  // never waits for it; a kept order costs one copy of the particle
+  // attributes instead of the count, scan and scatter of a sort. A full sort
+  // is still done every full_sort_interval steps. Not with verlet_list.
+  bool incremental_sort = false;
+  int full_sort_interval = 50;
+
+  // take the density for the pressure from the continuity equation
+  // (calculate_rho's drho) instead of a second calculate_rho sweep after
+  // advect_phase1; the difference is second order in dt. On the README's
+  // dam break it shifts the center of mass by at most 0.14 particle
+  // spacings and lowers the impact density peak from 1.150 to 1.126 rho0
+  bool predicted_density = true;
+
+  // bake h, mass, rho0, gamma, mu and the kernel normalization into the
+  // program as literals (integer gamma uses pown); the program is rebuilt
+  // when one of them changes, e.g. after calculate_mass
+  bool specialize = false;
+
+  // compiled programs are cached here, keyed by source, build options,
+  // device and driver; empty disables the cache
+#ifdef SPH_OPENCL_CACHE_DIR
+  std::string program_cache_dir = SPH_OPENCL_CACHE_DIR;
+#else
+  std::string program_cache_dir;
+#endif
+
+  // time every kernel launch and buffer transfer with OpenCL profiling
+  // events; engine_t::log_profile() prints the per-kernel table and writes
+  // a Chrome trace to profile_trace if set
+  bool profile = false;
+  std::string profile_trace;
+
+  // OpenCL device: "gpu", "cpu" or "accelerator" for the first device of
+  // that type, a number for the n-th device over all platforms, or a
+  // case-insensitive part of the device or platform name. Empty prefers a
+  // GPU and falls back to a CPU runtime such as PoCL; with ehfloat=double
+  // devices without cl_khr_fp64 are passed over.
+  std::string device;
+  // work-group size of the reductions and the prefix sum, rounded down to a
+  // power of two; 0 : 256 on GPUs, 64 on CPUs
+  int local_size = 0;
+
+  // step() waits for the device every sync_interval steps;
+  // 0 : only on explicit sync()
+  int sync_interval = 1;
+
+  // worker threads of native_engine_t; 0 : one per hardware thread
+  int threads = 0;
 };
 
 // Adding New Particle With this Info-Structure
@@ -75,7 +255,37 @@ struct particle_info_t
   cl_int color = 0;
 };
 
-struct engine_t
+// The step pipeline behind engine_t (OpenCL) and native_engine_t (C++
+// threads); set(), load(), add_particle() and calculate_mass() come before
+// the first step()
+struct backend_t
+{
+  virtual ~backend_t()
+  {
+  }
+  virtual void set(param_t& p) = 0;
+  // create the device or host resources for max_particle_count particles
+  virtual void load() = 0;
+  virtual void add_particle(particle_info_t const& info) = 0;
+  virtual void calculate_mass() = 0;
+  virtual void step() = 0;
+  // wait for the steps issued so far
+  virtual void sync() = 0;
+  virtual int particle_count() = 0;
+  virtual ehfloat simulated_time() = 0;
+  virtual std::string device_name() = 0;
+  // state of the particles in their current (cell-sorted) order
+  virtual void read_particles(std::vector<ehfloat3>& position,
+                              std::vector<ehfloat3>& velocity,
+                              std::vector<ehfloat>& rho,
+                              std::vector<cl_int>& flags)
+      = 0;
+  // total time of each kernel or phase since reset_profile(), ms
+  virtual std::map<std::string, double> profile_totals() = 0;
+  virtual void reset_profile() = 0;
+};
+
+struct engine_t : public backend_t
 {
   struct constant_t
   {
@@ -98,6 +308,8 @@ struct engine_t
     ehfloat pressure0;
     ehfloat static_rho;
     cl_int N;
+    cl_int neighbor_stride;
+    cl_int gridcells;
   };
 
   union
@@ -124,12 +336,104 @@ struct engine_t
       ehfloat pressure0;
       ehfloat static_rho;
       cl_int N;
+      cl_int neighbor_stride;
+      cl_int gridcells;
     };
   };
+  // last constants written to constant_buffer
+  constant_t uploaded_constants;
   int max_particle_count;
   int global_work_size;
+  int sync_interval = 1;
+  int step_count = 0;
+  // simulated time; with adaptive_dt refreshed from the device on sync()
+  ehfloat time = 0;
+
+  bool predicted_density = true;
+  bool specialize = false;
+  // specialized_constants() the program was built with
+  std::array<ehfloat, 7> built_constants = {};
+  std::string program_cache_dir;
+  // whether the last build_program() loaded a cached binary, and its time
+  bool program_cached = false;
+  double program_build_ms = 0;
+
+  bool profiling = false;
+  std::string profile_trace;
+  // events enqueued since the last collect_profile(); a deque keeps the
+  // pointers from profile_event() valid
+  std::deque<std::pair<char const*, cl::Event>> profile_pending;
+  struct profile_record_t
+  {
+    char const* name;
+    cl_ulong queued, submit, start, end;
+  };
+  struct profile_stat_t
+  {
+    // start to end, ms
+    std::vector<double> durations;
+    // queued to start, ms
+    double wait = 0;
+  };
+  std::map<std::string, profile_stat_t> profile_stats;
+  // every event, kept only for the trace
+  std::vector<profile_record_t> profile_records;
+  bool adaptive_dt = false;
+  ehfloat fixed_dt;
+  ehfloat max_dt;
+  ehfloat courant_dt_factor;
+  ehfloat force_dt_factor;
+  // (dt, time) of the adaptive stepper; dt_ring keeps the dt chosen at each
+  // step until sync() appends it to dt_history
+  cl::Buffer dt_state;
+  cl::Buffer dt_ring;
+  int dt_ring_size = 4096;
+  int dt_synced_step = 0;
+  std::vector<ehfloat> dt_history;
+
+  bool iisph = false;
+  int iisph_max_iterations;
+  int iisph_min_iterations;
+  ehfloat iisph_tolerance;
+  ehfloat iisph_omega;
+  cl::Buffer iisph_aii;
+  cl::Buffer iisph_source;
+  cl::Buffer iisph_error;
+  // see iisph_setup in kernels.cl
+  cl::Buffer iisph_state;
+  // refreshed on sync(); iterations are averaged over the steps since the
+  // previous sync()
+  struct
+  {
+    ehfloat iterations = 0;
+    ehfloat density_error = 0;
+    ehfloat max_density_error = 0;
+    long total_iterations = 0;
+    long steps = 0;
+  } iisph_stats;
+
+  bool incremental_sort = false;
+  int full_sort_interval = 50;
+  // steps left until the next forced full sort; 0 forces a sort
+  int sort_countdown = 0;
+  // read from sort_stats_buffer on sync()
+  struct
+  {
+    long steps = 0;
+    long skipped = 0;
+    long particles = 0;
+    long moved = 0;
+  } sort_stats;
+
+  bool verlet_list = false;
+  ehfloat skin;
+  // build_position holds the positions of the last sort, which built the
+  // neighbor list; the reuse is counted in sort_stats
+  bool verlet_valid = false;
 
   bool double_support;
+  std::string device_selector;
+  int local_size = 0;
   cl::Platform platform;
   cl::Device device;
   cl::Context context;
@@ -138,18 +442,32 @@ struct engine_t
   cl::Buffer constant_buffer;
 
   // grid-base
-  cl::Buffer grid_particlecount, grid_particlecount2;
+  cl::Buffer grid_particlecount;
 
   // retain values on grid_sort
   cl::Buffer position;
   cl::Buffer velocity;
   cl::Buffer svelocity;
   cl::Buffer flags;
-  cl::Buffer float3_pong, int_pong;
   cl::Buffer pressure;
   cl::Buffer V;
   cl::Buffer rho;
   cl::Buffer color;
+  // d(rho)/dt at the start of the step
+  cl::Buffer drho;
+  // pressure / rho^2 read by calculate_pressure_force
+  cl::Buffer pressure_rho2;
+
+  // back buffers of EH_PARTICLE_ATTRIBUTES and EH_IISPH_ATTRIBUTES, swapped
+  // in on grid_sort
+  struct
+  {
+#define EH_ATTRIBUTE_BUFFER(name, type) cl::Buffer name;
+    EH_PARTICLE_ATTRIBUTES(EH_ATTRIBUTE_BUFFER)
+    EH_IISPH_ATTRIBUTES(EH_ATTRIBUTE_BUFFER)
+#undef EH_ATTRIBUTE_BUFFER
+  } pong;
+
   cl::Buffer neighbors, neighbor_count;
 
   cl::Buffer nonpressure_force;
@@ -157,44 +475,206 @@ struct engine_t
 
   cl::Buffer gridindex;
   cl::Buffer grid_localindex;
+  // cell of each particle as of the last grid_sort, in sorted order
+  cl::Buffer cellindex;
+  // { order replaced this step, particles that left their sorted cell },
+  // always { 1, 0 } without incremental_sort or verlet_list; the positions
+  // of the last sort; and the totals of finish_grid_sort
+  cl::Buffer sort_state;
+  cl::Buffer build_position;
+  cl::Buffer sort_stats_buffer;
+  // { 1 }, for the gated kernels that must always run
+  cl::Buffer open_gate;
+
+  bool morton_grid = false;
+  bool hashed_grid = false;
+  bool neighbor_grid = false;
+  size_t neighbors_size;
+  // ints at the end of neighbors for the lists that outgrow neighbor_stride
+  size_t spill_size = 0;
+
+  // variant of each force kernel, 0 : nonpressure, 1 : pressure; see
+  // param_t::tiled_forces
+  bool tiled_force[2] = { false, false };
+  bool tune_forces = false;
+  // work-group size, and tile length, of the tiled force kernels
+  int tile_local_size = 64;
+  struct
+  {
+    bool active = false;
+    // steps timed so far; the first of each variant is a warm-up
+    int rounds = 0;
+    // ms[kernel][tiled] over the timed steps
+    double ms[2][2] = {};
+  } force_tuning;
+  // steps timed per variant by tune_forces
+  static constexpr int force_tuning_rounds = 4;
+  cl::Buffer neighbor_overflow;
+
+  // reduce_particles scratch; per-group partials and small results
+  int reduce_local_size = 256;
+  int reduce_groups = 64;
+  cl::Buffer reduce_partial;
+  cl::Buffer reduce_result;
+
+
+  // block sums for each level of the device prefix sum
+  std::vector<cl::Buffer> prefix_sum_blocks;
+  int prefix_sum_local_size = 256;
+
+  // particle count and neighbor total are read back asynchronously;
+  // sync_count() must be called before N is used on the host
+  cl::Event count_event;
+  cl_int count_readback;
+  cl_int neighbor_total = 0;
+  // largest neighbor count, spill taken by the last build and largest spill
+  // demand over the fixed-stride builds up to the readback; checked by
+  // check_neighbor_overflow()
+  cl::Event overflow_event;
+  cl_int overflow_readback[3] = {};
 
   cl::Program program;
 
   // OpenCL Kernels
   struct
   {
-    cl::KernelFunctor<cl::Buffer&, cl::Buffer&, cl_int, cl_int>
-        prefix_sum_phase1 { cl::Kernel() };
-    cl::KernelFunctor<cl::Buffer&, cl::Buffer&, cl_int, cl_int>
-        prefix_sum_phase2 { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl_int,
+                      cl::LocalSpaceArg,
+                      cl::Buffer&>
+        prefix_sum_block { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&, cl::Buffer&, cl_int, cl::Buffer&>
+        prefix_sum_add { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&, cl_int, cl::Buffer&> clear_count {
+      cl::Kernel()
+    };
     cl::KernelFunctor<cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
+                      cl::Buffer&,
                       cl::Buffer&>
         assume_grid_count { cl::Kernel() };
+    // arguments depend on EH_PARTICLE_ATTRIBUTES; set in grid_sort
+    cl::Kernel reorder_particles;
+    cl::KernelFunctor<cl::Buffer&, cl::Buffer&, cl::Buffer&>
+        finish_grid_sort { cl::Kernel() };
+
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&>
+        assume_neighbor_count { cl::Kernel() };
     cl::KernelFunctor<cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
-                      cl_int>
-        move_to_new_grid { cl::Kernel() };
+                      cl_int,
+                      cl::Buffer&>
+        make_neighborlist { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl_int,
+                      cl_int,
+                      cl::Buffer&>
+        make_neighborlist_fixed { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      ehfloat>
+        check_displacement { cl::Kernel() };
+
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl_int,
+                      cl_int,
+                      cl_int,
+                      cl::Buffer&,
+                      cl::LocalSpaceArg>
+        reduce_particles { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl_int,
+                      cl_int,
+                      cl::Buffer&,
+                      cl_int,
+                      cl::LocalSpaceArg>
+        reduce_partial { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl_int,
+                      ehfloat,
+                      ehfloat,
+                      ehfloat,
+                      ehfloat>
+        update_dt { cl::Kernel() };
 
     cl::KernelFunctor<cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&>
-        assume_neighbor_count { cl::Kernel() };
+        iisph_predict { cl::Kernel() };
     cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&>
-        make_neighborlist { cl::Kernel() };
+        iisph_setup { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl_int>
+        iisph_pressure_accel { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      ehfloat>
+        iisph_update_pressure { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&, ehfloat, cl_int> iisph_check {
+      cl::Kernel()
+    };
+    cl::KernelFunctor<cl::Buffer&> iisph_finish { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&>
+        iisph_integrate { cl::Kernel() };
 
     cl::KernelFunctor<cl::Buffer&,
                       cl::Buffer&,
@@ -202,6 +682,8 @@ struct engine_t
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
                       cl::Buffer&>
         calculate_rho { cl::Kernel() };
 
@@ -215,6 +697,19 @@ struct engine_t
                       cl::Buffer&,
                       cl::Buffer&>
         calculate_nonpressure_force { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::LocalSpaceArg,
+                      cl::LocalSpaceArg,
+                      cl::LocalSpaceArg,
+                      cl::LocalSpaceArg>
+        calculate_nonpressure_force_tiled { cl::Kernel() };
 
     cl::KernelFunctor<cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&>
         calculate_pressure { cl::Kernel() };
@@ -228,6 +723,17 @@ struct engine_t
                       cl::Buffer&,
                       cl::Buffer&>
         calculate_pressure_force { cl::Kernel() };
+    cl::KernelFunctor<cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
+                      cl::LocalSpaceArg,
+                      cl::LocalSpaceArg,
+                      cl::LocalSpaceArg>
+        calculate_pressure_force_tiled { cl::Kernel() };
 
     cl::KernelFunctor<cl::Buffer&,
                       cl::Buffer&,
@@ -235,6 +741,8 @@ struct engine_t
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
+                      cl::Buffer&,
+                      cl::Buffer&,
                       cl::Buffer&>
         advect_phase1 { cl::Kernel() };
 
@@ -244,6 +752,7 @@ struct engine_t
                       cl::Buffer&,
                       cl::Buffer&,
                       cl::Buffer&,
+                      cl::Buffer&,
                       cl::Buffer&>
         advect_phase2 { cl::Kernel() };
 
@@ -259,8 +768,61 @@ struct engine_t
   {
   }
   void load_opencl();
-  void set(param_t& p);
+  // pick platform and device from device_selector; see param_t::device
+  void select_device();
+  // build program from the kernel sources and create the kernels
+  void build_program();
+  std::string specialization_options();
+  // the scalars specialization_options() bakes into the program
+  std::array<ehfloat, 7> specialized_constants() const
+  {
+    return { H, invH, mass, rho0, gamma, pressure0, mu };
+  }
+  std::string program_cache_path(std::string const& source,
+                                 std::string const& options);
+  // false if there is no usable binary at path
+  bool load_program_binary(std::string const& path,
+                           std::string const& options);
+  void save_program_binary(std::string const& path);
+  // rebuild the program if the specialized constants changed
+  void update_specialization();
+  void set(param_t& p) override;
+  void load() override
+  {
+    load_opencl();
+  }
+  int particle_count() override
+  {
+    sync_count();
+    return N;
+  }
+  ehfloat simulated_time() override
+  {
+    return time;
+  }
+  std::string device_name() override
+  {
+    return device.getInfo<CL_DEVICE_NAME>();
+  }
+  void read_particles(std::vector<ehfloat3>& position_out,
+                      std::vector<ehfloat3>& velocity_out,
+                      std::vector<ehfloat>& rho_out,
+                      std::vector<cl_int>& flags_out) override
+  {
+    position_out = read_vec3(position);
+    velocity_out = read_vec3(velocity);
+    rho_out = get_buffer<ehfloat>(rho);
+    flags_out = get_buffer<cl_int>(flags);
+  }
+  std::map<std::string, double> profile_totals() override;
+  void reset_profile() override
+  {
+    profile_stats.clear();
+    profile_records.clear();
+  }
   void log();
+  void log_stats();
+  void log_neighbor_locality();
   void calculate_global_work_size()
   {
     int global_size_multiple = 16;
@@ -275,6 +837,28 @@ struct engine_t
     global_work_size *= global_size_multiple;
   }
 
+  // event argument for enqueue calls; nullptr unless profiling
+  cl::Event* profile_event(char const* name)
+  {
+    if (profiling == false)
+    {
+      return nullptr;
+    }
+    profile_pending.emplace_back(name, cl::Event());
+    return &profile_pending.back().second;
+  }
+  // record the event returned by a kernel launch
+  void profile(cl::Event const& event, char const* name)
+  {
+    if (profiling)
+    {
+      profile_pending.emplace_back(name, event);
+    }
+  }
+  // read the timestamps of the finished pending events
+  void collect_profile();
+  void log_profile();
+
   void check_kernel_error(cl_int err, char const* str)
   {
     if (err != CL_SUCCESS)
@@ -299,35 +883,36 @@ struct engine_t
     {
       return;
     }
+    sync_count();
     if (N + addparticle_waitlist.position.size() > max_particle_count)
     {
       throw std::runtime_error("particle count full error");
     }
     int n = addparticle_waitlist.position.size();
-    queue.enqueueWriteBuffer(position, CL_TRUE, sizeof(ehfloat3) * N,
-                             sizeof(ehfloat3) * n,
-                             addparticle_waitlist.position.data());
-    queue.enqueueWriteBuffer(velocity, CL_TRUE, sizeof(ehfloat3) * N,
-                             sizeof(ehfloat3) * n,
-                             addparticle_waitlist.velocity.data());
-    queue.enqueueWriteBuffer(svelocity, CL_TRUE, sizeof(ehfloat3) * N,
-                             sizeof(ehfloat3) * n,
-                             addparticle_waitlist.svelocity.data());
+    write_vec3(position, N, addparticle_waitlist.position, "write position");
+    write_vec3(velocity, N, addparticle_waitlist.velocity, "write velocity");
+    write_vec3(svelocity, N, addparticle_waitlist.svelocity,
+               "write svelocity");
     queue.enqueueWriteBuffer(flags, CL_TRUE, sizeof(cl_int) * N,
                              sizeof(cl_int) * n,
-                             addparticle_waitlist.flag.data());
+                             addparticle_waitlist.flag.data(), nullptr,
+                             profile_event("write flags"));
     queue.enqueueWriteBuffer(color, CL_TRUE, sizeof(cl_int) * N,
                              sizeof(cl_int) * n,
-                             addparticle_waitlist.color.data());
+                             addparticle_waitlist.color.data(), nullptr,
+                             profile_event("write color"));
 
     N += n;
+    calculate_global_work_size();
+    sort_countdown = 0;
+    verlet_valid = false;
     addparticle_waitlist.position.clear();
     addparticle_waitlist.velocity.clear();
     addparticle_waitlist.svelocity.clear();
     addparticle_waitlist.flag.clear();
     addparticle_waitlist.color.clear();
   }
-  void add_particle(particle_info_t const& info)
+  void add_particle(particle_info_t const& info) override
   {
     addparticle_waitlist.position.push_back(info.position);
     addparticle_waitlist.velocity.push_back(info.velocity);
@@ -343,28 +928,97 @@ struct engine_t
 
   void upload_constants()
   {
+    // N on the device may be ahead of the host after grid_sort
+    sync_count();
     queue.enqueueWriteBuffer(constant_buffer, CL_TRUE, 0, sizeof(constant_t),
-                             &constants);
+                             &constants, nullptr,
+                             profile_event("write constant_buffer"));
+    std::memcpy(&uploaded_constants, &constants, sizeof(constant_t));
+    if (adaptive_dt)
+    {
+      // the host dt lags behind the device until the next sync()
+      queue.enqueueCopyBuffer(dt_state, constant_buffer, 0,
+                              offsetof(constant_t, dt), sizeof(ehfloat),
+                              nullptr, profile_event("copy dt_state"));
+    }
   }
 
   template <typename T>
-  std::vector<T> get_buffer(cl::Buffer& buf)
+  std::vector<T> get_buffer(cl::Buffer& buf, int count = -1)
   {
-    std::vector<T> data(N);
-    queue.enqueueReadBuffer(buf, CL_TRUE, 0, sizeof(T) * N, data.data());
+    sync_count();
+    std::vector<T> data(count < 0 ? N : count);
+    queue.enqueueReadBuffer(buf, CL_TRUE, 0, sizeof(T) * data.size(),
+                            data.data(), nullptr, profile_event("get_buffer"));
     return data;
   }
 
-  void prefix_sum(cl::Buffer& buf, int N);
+  // ehvec3 buffers from and to ehfloat3 on the host, in either layout
+  void write_vec3(cl::Buffer& buf,
+                  int offset,
+                  std::vector<ehfloat3> const& data,
+                  char const* name);
+  std::vector<ehfloat3> read_vec3(cl::Buffer& buf);
+
+  void sync_count();
+  void prefix_sum(cl::Buffer& buf, int N, cl::Buffer& gate, int level = 0);
   void grid_sort();
   void make_neighbors();
-  void calculate_mass();
+  void make_neighbors_fixed();
+  // grow neighbor_stride once an overflow has been read back; wait : block
+  // for a pending readback instead of leaving it to a later call
+  void check_neighbor_overflow(bool wait);
+  // gate of the neighbor-build kernels: only a verlet_list is kept
+  cl::Buffer& neighbor_gate()
+  {
+    return verlet_list ? sort_state : open_gate;
+  }
+  // neighbor_begin argument of the force kernels
+  cl::Buffer& neighbor_begin()
+  {
+    return neighbor_grid ? grid_particlecount : neighbor_count;
+  }
+  // grid_sort and make_neighbors, skipped while the Verlet list is valid
+  void update_neighbors();
+  // reduce buf over the particles without exclude_flags into
+  // result[offset] on the device; op is EH_REDUCE_*, element is
+  // EH_REDUCE_SCALAR for ehfloat buffers or EH_REDUCE_LENGTH(_SQ) for ehfloat3
+  void reduce(cl::Buffer& buf,
+              int op,
+              int element,
+              int exclude_flags,
+              cl::Buffer& result,
+              int offset);
+  // same, read back to the host
+  ehfloat reduce(cl::Buffer& buf, int op, int element, int exclude_flags);
+  ehfloat max_velocity();
+  ehfloat kinetic_energy();
+  ehfloat max_density_error();
+
+  void calculate_mass() override;
   void calculate_rho();
   void calculate_nonpressure_force();
   void calculate_pressure();
   void calculate_pressure_force();
+  // launch(tiled) with the variant chosen for kernel (see tiled_force);
+  // while tuning, alternates the variants and times them
+  void launch_force_kernel(int kernel, std::function<void(bool)> const& launch);
+  // pick the faster variants once tune_forces has timed enough steps
+  void finish_force_tuning();
   void advect_phase1();
   void advect_phase2();
   void advect();
-  void step();
+  // pressure solve and time integration replacing calculate_pressure ..
+  // advect_phase2; see param_t::iisph
+  void iisph_solve();
+  // choose the next dt on the device; see param_t::adaptive_dt
+  void update_dt();
+
+  // enqueue one step; kernels are ordered by the in-order queue and the host
+  // only waits on sync()
+  void step() override;
+  // enqueue `steps` steps back-to-back
+  void run(int steps);
+  // wait for all enqueued work and refresh N, dt and time on the host
+  void sync() override;
 };
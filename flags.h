@@ -11,4 +11,18 @@
 
 #define STATIC_MASS 1.2
 
+// reduce_particles operations
+#define EH_REDUCE_SUM 0
+#define EH_REDUCE_MIN 1
+#define EH_REDUCE_MAX 2
+
+// reduce_particles element interpretation
+#define EH_REDUCE_SCALAR 0
+#define EH_REDUCE_LENGTH 1
+#define EH_REDUCE_LENGTH_SQ 2
+// counts the particles; the buffer is not read
+#define EH_REDUCE_COUNT 3
+// length of an ehhalf3 element, for EH_HALF builds
+#define EH_REDUCE_HALF_LENGTH 4
+
 #endif
@@ -19,145 +19,544 @@ struct constant_t
   ehfloat pressure0;
   ehfloat static_rho;
   int N;
+  int neighbor_stride;
+  int gridcells;
 };
 
+// constants fixed for a run; a specialized build passes them as literals
+// with -D so they fold into the code, otherwise they are read from c
+#ifndef EH_H
+  #define EH_H (c->H)
+#endif
+#ifndef EH_INVH
+  #define EH_INVH (c->invH)
+#endif
+#ifndef EH_MASS
+  #define EH_MASS (c->mass)
+#endif
+#ifndef EH_RHO0
+  #define EH_RHO0 (c->rho0)
+#endif
+#ifndef EH_GAMMA
+  #define EH_GAMMA (c->gamma)
+#endif
+#ifndef EH_PRESSURE0
+  #define EH_PRESSURE0 (c->pressure0)
+#endif
+#ifndef EH_MU
+  #define EH_MU (c->mu)
+#endif
+// normalization of the poly6 kernel and of its gradient
+#ifndef EH_POLY6_NORM
+  #define EH_POLY6_NORM(invh)                           \
+    (315.0 / (64.0 * EH_PI) * (invh) * (invh) * (invh))
+#endif
+#ifndef EH_POLY6_GRAD_NORM
+  #define EH_POLY6_GRAD_NORM(invh)                                         \
+    (-945.0 / (32.0 * EH_PI) * (invh) * (invh) * (invh) * (invh) * (invh))
+#endif
+
+// storage of the per-particle vectors. By default an ehvec3 is an ehfloat3,
+// padded to four components; with EH_SOA a buffer holds the x, y and z
+// planes of EH_SOA_STRIDE scalars each, so every vector access moves three
+// components and consecutive particles stay contiguous in each plane.
+#ifdef EH_SOA
+typedef ehfloat ehvec3;
+  #define EH_LOAD3(p, i)                          \
+    ((ehfloat3)((p)[i], (p)[(i) + EH_SOA_STRIDE], \
+                (p)[(i) + 2 * EH_SOA_STRIDE]))
+  #define EH_STORE3(p, i, v)               \
+    do                                     \
+    {                                      \
+      const ehfloat3 v_ = (v);             \
+      (p)[i] = v_.x;                       \
+      (p)[(i) + EH_SOA_STRIDE] = v_.y;     \
+      (p)[(i) + 2 * EH_SOA_STRIDE] = v_.z; \
+    } while (0)
+#else
+typedef ehfloat3 ehvec3;
+  #define EH_LOAD3(p, i) ((p)[i])
+  #define EH_STORE3(p, i, v) ((p)[i] = (v))
+#endif
+
+// accumulators of the long neighbor sums, the density and the pressure
+// force. With EH_MIXED the particle data stays float and only these sums
+// are carried in double; otherwise ehacc is ehfloat and the conversions
+// vanish.
+#ifdef EH_MIXED
+typedef double ehacc;
+typedef double3 ehacc3;
+  #define EH_ACC3(v) convert_double3(v)
+  #define EH_FROM_ACC3(v) convert_float3(v)
+#else
+typedef ehfloat ehacc;
+typedef ehfloat3 ehacc3;
+  #define EH_ACC3(v) (v)
+  #define EH_FROM_ACC3(v) (v)
+#endif
+
+// storage of the attributes that do not need full precision: the volume
+// V, p / rho^2 and the nonpressure force, which advect_phase1 turns into the
+// acceleration read by update_dt. With EH_HALF they are half buffers that
+// are only touched by vload_half/vstore_half, core functions that need no
+// cl_khr_fp16 arithmetic. V is kept in units of the nominal particle volume
+// EH_MASS / EH_RHO0, since its raw value lies among the half subnormals.
+#ifdef EH_HALF
+typedef half ehhalf;
+typedef half ehhalf3;
+ehfloat3 eh_load_half3(int i, global const half* p)
+{
+  const float3 h = vload_half3(i, p);
+  return (ehfloat3)(h.x, h.y, h.z);
+}
+void eh_store_half3(int i, global half* p, ehfloat3 v)
+{
+  vstore_half3((float3)(v.x, v.y, v.z), i, p);
+}
+  #define EH_LOADH(p, i) ((ehfloat)vload_half(i, p))
+  #define EH_STOREH(p, i, v) vstore_half((float)(v), i, p)
+  #define EH_LOADH3(p, i) eh_load_half3(i, p)
+  #define EH_STOREH3(p, i, v) eh_store_half3(i, p, v)
+  #define EH_V_UNIT (EH_MASS / EH_RHO0)
+#else
+typedef ehfloat ehhalf;
+typedef ehvec3 ehhalf3;
+  #define EH_LOADH(p, i) ((p)[i])
+  #define EH_STOREH(p, i, v) ((p)[i] = (v))
+  #define EH_LOADH3(p, i) EH_LOAD3(p, i)
+  #define EH_STOREH3(p, i, v) EH_STORE3(p, i, v)
+  #define EH_V_UNIT 1
+#endif
+#define EH_LOAD_V(p, i) (EH_LOADH(p, i) * EH_V_UNIT)
+#define EH_STORE_V(p, i, v) EH_STOREH(p, i, (v) / EH_V_UNIT)
+
 int3 gridindex3_from_p3(constant struct constant_t* c, ehfloat3 p)
 {
   return convert_int3_rtn((p - c->minbound) * c->gridinvH);
 }
+#if defined(EH_GRID_HASH)
+// spatial hash of the cell; gridcells is the power-of-two table size and
+// cells of the whole space share its buckets
+int gridindex_from_index3(constant struct constant_t* c, int3 i3)
+{
+  uint h = ((uint)i3.x * 73856093u) ^ ((uint)i3.y * 19349663u)
+           ^ ((uint)i3.z * 83492791u);
+  return h & (c->gridcells - 1);
+}
+#elif defined(EH_GRID_MORTON)
+// insert two zero bits between each of the low 10 bits of x
+int morton_spread(int x)
+{
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+// Z-order cell index; the 27 cells around a particle stay close in memory
+int gridindex_from_index3(constant struct constant_t* c, int3 i3)
+{
+  return morton_spread(i3.x) | (morton_spread(i3.y) << 1)
+         | (morton_spread(i3.z) << 2);
+}
+// inverse of morton_spread
+int morton_compact(int x)
+{
+  x &= 0x09249249;
+  x = (x | (x >> 2)) & 0x030c30c3;
+  x = (x | (x >> 4)) & 0x0300f00f;
+  x = (x | (x >> 8)) & 0x030000ff;
+  x = (x | (x >> 16)) & 0x3ff;
+  return x;
+}
+int3 index3_from_gridindex(constant struct constant_t* c, int g)
+{
+  return (int3)(morton_compact(g), morton_compact(g >> 1),
+                morton_compact(g >> 2));
+}
+#else
 int gridindex_from_index3(constant struct constant_t* c, int3 i3)
 {
   return (i3.z * c->gridsize.y + i3.y) * c->gridsize.x + i3.x;
 }
+int3 index3_from_gridindex(constant struct constant_t* c, int g)
+{
+  return (int3)(g % c->gridsize.x, (g / c->gridsize.x) % c->gridsize.y,
+                g / (c->gridsize.x * c->gridsize.y));
+}
+#endif
+// cell of p; particles outside the bound go to the overflow cell
+int gridindex_from_p3(constant struct constant_t* c, ehfloat3 p)
+{
+  int3 index3 = gridindex3_from_p3(c, p);
+#ifndef EH_GRID_HASH
+  if (any(index3 < (int3)(0)) || any(index3 >= c->gridsize))
+  {
+    return c->gridcells;
+  }
+#endif
+  return gridindex_from_index3(c, index3);
+}
+// first and last cell of the 3x3x3 stencil around index3
+int3 stencil_min(constant struct constant_t* c, int3 index3)
+{
+#ifdef EH_GRID_HASH
+  return index3 - 1;
+#else
+  return max(index3 - 1, 0);
+#endif
+}
+int3 stencil_max(constant struct constant_t* c, int3 index3)
+{
+#ifdef EH_GRID_HASH
+  return index3 + 1;
+#else
+  return min(index3 + 1, c->gridsize - 1);
+#endif
+}
+
+#ifdef EH_GRID_HASH
+// distinct buckets of the cells in lo..hi; cells sharing a bucket must only
+// be walked once
+int stencil_buckets(constant struct constant_t* c, int3 lo, int3 hi, int* out)
+{
+  int n = 0;
+  for (int gz = lo.z; gz <= hi.z; ++gz)
+  {
+    for (int gy = lo.y; gy <= hi.y; ++gy)
+    {
+      for (int gx = lo.x; gx <= hi.x; ++gx)
+      {
+        int bucket = gridindex_from_index3(c, (int3)(gx, gy, gz));
+        bool seen = false;
+        for (int k = 0; k < n; ++k)
+        {
+          seen = seen || out[k] == bucket;
+        }
+        if (!seen)
+        {
+          out[n++] = bucket;
+        }
+      }
+    }
+  }
+  return n;
+}
+#endif
+
+// FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, lo, hi) { ... } visits
+// the particle ranges [begin, end) of the cells in lo..hi
+#if defined(EH_GRID_HASH)
+  // bucket ranges may hold particles of colliding far cells, which the
+  // distance checks of the callers reject
+  #define FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, lo, hi)     \
+    for (int buckets_[27], nb_ = stencil_buckets(c, lo, hi, buckets_), \
+             b_ = 0;                                                   \
+         b_ < nb_; ++b_)                                               \
+      for (int begin = grid_beginpoint[buckets_[b_]],                  \
+               end = grid_beginpoint[buckets_[b_] + 1];                \
+           begin < end; begin = end)
+#elif defined(EH_GRID_MORTON)
+  #define FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, lo, hi) \
+    for (int gz_ = (lo).z; gz_ <= (hi).z; ++gz_)                   \
+      for (int gy_ = (lo).y; gy_ <= (hi).y; ++gy_)                 \
+        for (int gx_ = (lo).x; gx_ <= (hi).x; ++gx_)               \
+          for (int cell_ = gridindex_from_index3(                  \
+                   c, (int3)(gx_, gy_, gz_)),                      \
+                   begin = grid_beginpoint[cell_],                 \
+                   end = grid_beginpoint[cell_ + 1];               \
+               begin < end; begin = end)
+#else
+  // row-major cells along x are contiguous, so each x-run is one range
+  #define FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, lo, hi)      \
+    for (int gz_ = (lo).z; gz_ <= (hi).z; ++gz_)                        \
+      for (int gy_ = (lo).y; gy_ <= (hi).y; ++gy_)                      \
+        for (int begin = grid_beginpoint[gridindex_from_index3(         \
+                 c, (int3)((lo).x, gy_, gz_))],                         \
+                 end = grid_beginpoint[gridindex_from_index3(           \
+                                           c, (int3)((hi).x, gy_, gz_)) \
+                                       + 1];                            \
+             begin < end; begin = end)
+#endif
+
+#ifndef EH_GRID_HASH
+// FOR_EACH_TILE(t, n, lo, hi) { ... } visits the particles of the cells in
+// lo..hi in tiles [t, t + n) of at most the work-group size. The bounds are
+// the same for every work-item of the group, so the body may hold barriers.
+// Expects c and grid_beginpoint in scope.
+  #define FOR_EACH_TILE(t, n, lo, hi)                                   \
+    FOR_EACH_CELL_RANGE(tbegin_, tend_, grid_beginpoint, lo, hi)        \
+      for (int t = tbegin_, n = min((int)get_local_size(0), tend_ - t); \
+           t < tend_; t += get_local_size(0),                           \
+               n = min((int)get_local_size(0), tend_ - t))
+#endif
+
+// neighbors of id are neighbors[range.x .. range.y)
+// neighbor_stride == 0 : neighbor_begin is the prefix-summed count list
+// neighbor_stride > 0 : neighbor_begin is the count of fixed-stride slots,
+//                       or -(o + 1) for a list spilled to neighbors[o + 1 ..]
+//                       with its length at neighbors[o]
+int2 neighbor_range(constant struct constant_t* c,
+                    global const int* neighbor_begin,
+                    global const int* neighbors,
+                    int id)
+{
+  if (c->neighbor_stride > 0)
+  {
+    const int n = neighbor_begin[id];
+    if (n < 0)
+    {
+      return (int2)(-n, -n + neighbors[-n - 1]);
+    }
+    const int begin = id * c->neighbor_stride;
+    return (int2)(begin, begin + n);
+  }
+  return (int2)(neighbor_begin[id], neighbor_begin[id + 1]);
+}
+
+// FOR_EACH_NEIGHBOR(j) { ... } visits the neighbor candidates j of particle
+// id; `continue` skips to the next candidate.
+// Expects c, neighbor_begin, neighbors, position and id in scope.
+#ifdef EH_NEIGHBOR_GRID
+  // walk the 27 cells around id directly; neighbor_begin is the prefix-summed
+  // grid_particlecount and neighbors is unused
+  #define FOR_EACH_NEIGHBOR(j)                                      \
+    for (int3 i3_ = gridindex3_from_p3(c, EH_LOAD3(position, id)),  \
+              lo_ = stencil_min(c, i3_), hi_ = stencil_max(c, i3_); \
+         lo_.x <= hi_.x; lo_.x = hi_.x + 1)                         \
+      FOR_EACH_CELL_RANGE(begin_, end_, neighbor_begin, lo_, hi_)   \
+        for (int j = begin_; j < end_; ++j)
+#else
+  #define FOR_EACH_NEIGHBOR(j)                                 \
+    for (int2 range_ = neighbor_range(c, neighbor_begin, neighbors, id); \
+         range_.x < range_.y; range_.x = range_.y)                       \
+      for (int jj_ = range_.x, j;                                        \
+           jj_ < range_.y && ((j = neighbors[jj_]), 1); ++jj_)
+#endif
 
 // poly6 kernel
 // W = W0 * ( 1 - (r/h)^2 )^3
 ehfloat kernel_function(ehfloat invh, ehfloat3 x)
 {
   ehfloat q = max(1.0 - dot(x, x) * invh * invh, 0.0);
-  return 315.0 / (64.0 * EH_PI) * invh * invh * invh * q * q * q;
+  return EH_POLY6_NORM(invh) * q * q * q;
 }
 ehfloat3 kernel_gradient(ehfloat invh, ehfloat3 x)
 {
   ehfloat q = max(1.0 - dot(x, x) * invh * invh, 0.0);
-  return -945.0 / (32.0 * EH_PI) * invh * invh * invh * invh * invh * q * q * x;
+  return EH_POLY6_GRAD_NORM(invh) * q * q * x;
 }
 
+// grid_sort kernels return early (reorder_particles copies instead) when
+// check_displacement has left gate[0] clear, i.e. the order of the last sort
+// still covers every neighbor (see engine_t::update_neighbors)
+kernel void clear_count(global int* count, int n, global const int* gate)
+{
+  const int id = get_global_id(0);
+  if (id >= n || gate[0] == 0)
+  {
+    return;
+  }
+  count[id] = 0;
+}
 kernel void assume_grid_count(constant struct constant_t* c,
                               global int* gridcount,
                               global int* grid_localindex,
-                              global const ehfloat3* position,
-                              global int* gridindex)
+                              global const ehvec3* position,
+                              global int* gridindex,
+                              global const int* gate)
 {
   const int id = get_global_id(0);
-  if (id >= c->N)
+  if (id >= c->N || gate[0] == 0)
   {
     return;
   }
 
-  int3 index3 = gridindex3_from_p3(c, position[id]);
-  int index1 = gridindex_from_index3(c, index3);
-  if (any(index3 < (int3)(0)) || any(index3 >= c->gridsize))
-  {
-    index1 = c->gridsize.x * c->gridsize.y * c->gridsize.z;
-  }
+  int index1 = gridindex_from_p3(c, EH_LOAD3(position, id));
   gridindex[id] = index1;
 
   grid_localindex[id] = atomic_inc(gridcount + index1);
 }
-kernel void prefix_sum_phase1(global int* A, global int* B, int N, int D)
+// work-efficient (Blelloch) exclusive scan over 2*local_size elements per
+// work-group; each group's total is stored in block_sum[group]
+kernel void prefix_sum_block(global int* A,
+                             global int* block_sum,
+                             int N,
+                             local int* temp,
+                             global const int* gate)
 {
-  int i = get_global_id(0);
-  int x = 0;
-  while (i <= N)
+  if (gate[0] == 0)
+  {
+    return;
+  }
+  const int lid = get_local_id(0);
+  const int n = get_local_size(0) * 2;
+  const int offset = get_group_id(0) * n;
+
+  temp[2 * lid] = (offset + 2 * lid < N) ? A[offset + 2 * lid] : 0;
+  temp[2 * lid + 1]
+      = (offset + 2 * lid + 1 < N) ? A[offset + 2 * lid + 1] : 0;
+
+  // up-sweep
+  int d = 1;
+  for (int s = n >> 1; s > 0; s >>= 1)
   {
-    x += A[i];
-    B[i] = x;
-    i += D;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s)
+    {
+      temp[d * (2 * lid + 2) - 1] += temp[d * (2 * lid + 1) - 1];
+    }
+    d <<= 1;
   }
-}
-kernel void prefix_sum_phase2(global int* A, global int* B, int N, int D)
-{
-  int i = get_global_id(0);
-  int x = 0;
-  for (int j = max(0, i - D); j < i; ++j)
+  if (lid == 0)
+  {
+    block_sum[get_group_id(0)] = temp[n - 1];
+    temp[n - 1] = 0;
+  }
+
+  // down-sweep
+  for (int s = 1; s < n; s <<= 1)
   {
-    x += B[j];
+    d >>= 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s)
+    {
+      const int ai = d * (2 * lid + 1) - 1;
+      const int bi = d * (2 * lid + 2) - 1;
+      const int t = temp[ai];
+      temp[ai] = temp[bi];
+      temp[bi] += t;
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (offset + 2 * lid < N)
+  {
+    A[offset + 2 * lid] = temp[2 * lid];
+  }
+  if (offset + 2 * lid + 1 < N)
+  {
+    A[offset + 2 * lid + 1] = temp[2 * lid + 1];
   }
-  A[i] = x;
 }
-kernel void move_to_new_grid(constant struct constant_t* c,
-                             global const int* grid_beginpoint,
-                             global const int* grid_localindex,
-                             global const int* gridindex,
-                             global const int* A,
-                             global int* newA,
-                             int type)
+// add scanned block sums back to each block of prefix_sum_block
+kernel void prefix_sum_add(global int* A,
+                           global const int* block_sum,
+                           int N,
+                           global const int* gate)
 {
-  const int id = get_global_id(0);
-  if (id >= c->N)
+  if (gate[0] == 0)
   {
     return;
   }
+  const int lid = get_local_id(0);
+  const int n = get_local_size(0) * 2;
+  const int offset = get_group_id(0) * n;
+  const int x = block_sum[get_group_id(0)];
 
-  int to_id = grid_beginpoint[gridindex[id]] + grid_localindex[id];
-  if (type == 0)
+  if (offset + 2 * lid < N)
   {
-    newA[to_id] = A[id];
+    A[offset + 2 * lid] += x;
   }
-  else if (type == 1)
+  if (offset + 2 * lid + 1 < N)
   {
-    global ehfloat* newA_ = (global ehfloat*)newA;
-    global const ehfloat* A_ = (global const ehfloat*)A;
-    newA_[to_id] = A_[id];
+    A[offset + 2 * lid + 1] += x;
   }
-  else if (type == 2)
+}
+// scatter every attribute in EH_PARTICLE_ATTRIBUTES, and with EH_IISPH those
+// in EH_IISPH_ATTRIBUTES, to its sorted position, or copy it in place if
+// gate[0] keeps the order, so that the host can always swap the buffers.
+// With reuse set, build_position remembers the positions of this sort.
+#ifdef EH_IISPH
+  #define EH_SORTED_ATTRIBUTES(X) \
+    EH_PARTICLE_ATTRIBUTES(X) EH_IISPH_ATTRIBUTES(X)
+#else
+  #define EH_SORTED_ATTRIBUTES(X) EH_PARTICLE_ATTRIBUTES(X)
+#endif
+#define EH_ATTRIBUTE_PARAM(name, type)              \
+  global const type* name, global type* new_##name,
+kernel void reorder_particles(constant struct constant_t* c,
+                              global const int* grid_beginpoint,
+                              global const int* grid_localindex,
+                              EH_SORTED_ATTRIBUTES(EH_ATTRIBUTE_PARAM)
+                              global const int* gridindex,
+                              global int* cellindex,
+                              global ehvec3* build_position,
+                              global const int* gate,
+                              int reuse)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
   {
-    global ehfloat2* newA_ = (global ehfloat2*)newA;
-    global const ehfloat2* A_ = (global const ehfloat2*)A;
-    newA_[to_id] = A_[id];
+    return;
   }
-  else if (type == 3)
+
+  const int sort = gate[0];
+  const int to_id
+      = sort ? grid_beginpoint[gridindex[id]] + grid_localindex[id] : id;
+#define EH_ATTRIBUTE_MOVE(name, type) EH_MOVE_##type(name)
+#define EH_MOVE_int(name) new_##name[to_id] = name[id];
+#define EH_MOVE_ehfloat(name) new_##name[to_id] = name[id];
+#define EH_MOVE_ehvec3(name) EH_STORE3(new_##name, to_id, EH_LOAD3(name, id));
+  EH_SORTED_ATTRIBUTES(EH_ATTRIBUTE_MOVE)
+#undef EH_MOVE_int
+#undef EH_MOVE_ehfloat
+#undef EH_MOVE_ehvec3
+#undef EH_ATTRIBUTE_MOVE
+  if (sort == 0)
+  {
+    return;
+  }
+  cellindex[to_id] = gridindex[id];
+  if (reuse)
   {
-    global ehfloat3* newA_ = (global ehfloat3*)newA;
-    global const ehfloat3* A_ = (global const ehfloat3*)A;
-    newA_[to_id] = A_[id];
+    EH_STORE3(build_position, to_id, EH_LOAD3(position, id));
   }
 }
+#undef EH_ATTRIBUTE_PARAM
+#undef EH_SORTED_ATTRIBUTES
+// sort_stats: steps, steps that kept the order, particles, and particles
+// outside the cell of the last sort
+kernel void finish_grid_sort(constant struct constant_t* c,
+                             global const int* sort_state,
+                             global long* sort_stats)
+{
+  sort_stats[0] += 1;
+  sort_stats[1] += sort_state[0] == 0;
+  sort_stats[2] += c->N;
+  sort_stats[3] += sort_state[1];
+}
+// the neighbor-build kernels return early while gate[0] is clear, i.e. the
+// verlet_list built at the last sort is still valid
 kernel void assume_neighbor_count(constant struct constant_t* c,
                                   global const int* grid_beginpoint,
-                                  global const ehfloat3* position,
+                                  global const ehvec3* position,
                                   global const int* flags,
-                                  global int* neighbor_count)
+                                  global int* neighbor_count,
+                                  global const int* gate)
 {
   const int id = get_global_id(0);
-  if (id >= c->N)
+  if (id >= c->N || gate[0] == 0)
   {
     return;
   }
+  const ehfloat3 xi = EH_LOAD3(position, id);
 
   int count = 0;
-  int3 index3 = gridindex3_from_p3(c, position[id]);
-  int3 mingrid = max(index3 - 1, 0);
-  int3 maxgrid = min(index3 + 1, c->gridsize - 1);
-  for (int gridz = mingrid.z; gridz <= maxgrid.z; ++gridz)
-  {
-    for (int gridy = mingrid.y; gridy <= maxgrid.y; ++gridy)
-    {
-      int begin = grid_beginpoint[gridindex_from_index3(
-          c, (int3)(mingrid.x, gridy, gridz))];
-      int end = grid_beginpoint[gridindex_from_index3(
-                                    c, (int3)(maxgrid.x, gridy, gridz))
-                                + 1];
-      for (int j = begin; j < end; ++j)
+  int3 index3 = gridindex3_from_p3(c, xi);
+  int3 mingrid = stencil_min(c, index3);
+  int3 maxgrid = stencil_max(c, index3);
+  FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, mingrid, maxgrid)
+  {
+    for (int j = begin; j < end; ++j)
+    {
+      ehfloat3 rij = xi - EH_LOAD3(position, j);
+      if (dot(rij, rij) > c->gridH * c->gridH)
       {
-        ehfloat3 rij = position[id] - position[j];
-        if (dot(rij, rij) > c->gridH * c->gridH)
-        {
-          continue;
-        }
-        ++count;
+        continue;
       }
+      ++count;
     }
   }
   if (count > 100)
@@ -169,50 +568,295 @@ kernel void assume_neighbor_count(constant struct constant_t* c,
 }
 kernel void make_neighborlist(constant struct constant_t* c,
                               global const int* grid_beginpoint,
-                              global const ehfloat3* position,
+                              global const ehvec3* position,
                               global const int* flags,
                               global const int* neighbor_begin,
-                              global int* neighbors)
+                              global int* neighbors,
+                              int capacity,
+                              global const int* gate)
 {
   const int id = get_global_id(0);
-  if (id >= c->N)
+  if (id >= c->N || gate[0] == 0)
   {
     return;
   }
+  const ehfloat3 xi = EH_LOAD3(position, id);
 
   int count = 0;
-  int3 index3 = gridindex3_from_p3(c, position[id]);
-  int3 mingrid = max(index3 - 1, 0);
-  int3 maxgrid = min(index3 + 1, c->gridsize - 1);
-  for (int gridz = mingrid.z; gridz <= maxgrid.z; ++gridz)
-  {
-    for (int gridy = mingrid.y; gridy <= maxgrid.y; ++gridy)
-    {
-      int begin = grid_beginpoint[gridindex_from_index3(
-          c, (int3)(mingrid.x, gridy, gridz))];
-      int end = grid_beginpoint[gridindex_from_index3(
-                                    c, (int3)(maxgrid.x, gridy, gridz))
-                                + 1];
-      for (int j = begin; j < end; ++j)
+  int3 index3 = gridindex3_from_p3(c, xi);
+  int3 mingrid = stencil_min(c, index3);
+  int3 maxgrid = stencil_max(c, index3);
+  FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, mingrid, maxgrid)
+  {
+    for (int j = begin; j < end; ++j)
+    {
+      ehfloat3 rij = xi - EH_LOAD3(position, j);
+      if (dot(rij, rij) > c->gridH * c->gridH)
+      {
+        continue;
+      }
+      // overflow is reported on the host from the scanned total
+      if (neighbor_begin[id] + count < capacity)
       {
-        ehfloat3 rij = position[id] - position[j];
-        if (dot(rij, rij) > c->gridH * c->gridH)
-        {
-          continue;
-        }
         neighbors[neighbor_begin[id] + count] = j;
-        ++count;
       }
+      ++count;
+    }
+  }
+}
+
+// single-pass neighbor list into fixed-stride slots. A particle with more
+// neighbors walks its cells again and writes the whole list into the spill
+// region neighbors[spill_begin .. spill_end), so no list is ever cut short
+// while the spill has room. overflow holds the largest count seen and the
+// largest spill demand since the host last read them, for growing the
+// stride and the spill, and the spill space taken by this build.
+kernel void make_neighborlist_fixed(constant struct constant_t* c,
+                                    global const int* grid_beginpoint,
+                                    global const ehvec3* position,
+                                    global const int* flags,
+                                    global int* neighbor_count,
+                                    global int* neighbors,
+                                    global int* overflow,
+                                    int spill_begin,
+                                    int spill_end,
+                                    global const int* gate)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N || gate[0] == 0)
+  {
+    return;
+  }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+
+  const int stride = c->neighbor_stride;
+  int count = 0;
+  int3 index3 = gridindex3_from_p3(c, xi);
+  int3 mingrid = stencil_min(c, index3);
+  int3 maxgrid = stencil_max(c, index3);
+  FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, mingrid, maxgrid)
+  {
+    for (int j = begin; j < end; ++j)
+    {
+      ehfloat3 rij = xi - EH_LOAD3(position, j);
+      if (dot(rij, rij) > c->gridH * c->gridH)
+      {
+        continue;
+      }
+      if (count < stride)
+      {
+        neighbors[id * stride + count] = j;
+      }
+      ++count;
+    }
+  }
+  if (count <= stride)
+  {
+    neighbor_count[id] = count;
+    return;
+  }
+  atomic_max(&overflow[0], count);
+  const int o = spill_begin + atomic_add(&overflow[1], count + 1);
+  atomic_max(&overflow[2], o + count + 1 - spill_begin);
+  if (o > spill_end - count - 1)
+  {
+    // only when more lists overflow at once than the spill holds
+    neighbor_count[id] = stride;
+    return;
+  }
+  neighbors[o] = count;
+  int k = o + 1;
+  FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, mingrid, maxgrid)
+  {
+    for (int j = begin; j < end; ++j)
+    {
+      ehfloat3 rij = xi - EH_LOAD3(position, j);
+      if (dot(rij, rij) > c->gridH * c->gridH)
+      {
+        continue;
+      }
+      neighbors[k++] = j;
     }
   }
+  neighbor_count[id] = -(o + 1);
+}
+
+// raise gate[0] once any particle moved more than limit since the last sort,
+// which no longer covers every neighbor then; gate[1] counts the particles
+// outside the cell of that sort
+kernel void check_displacement(constant struct constant_t* c,
+                               global const ehvec3* position,
+                               global const ehvec3* build_position,
+                               global const int* cellindex,
+                               global int* gate,
+                               ehfloat limit)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  if (gridindex_from_p3(c, xi) != cellindex[id])
+  {
+    atomic_inc(gate + 1);
+  }
+  const ehfloat3 d = xi - EH_LOAD3(build_position, id);
+  if (dot(d, d) > limit * limit)
+  {
+    gate[0] = 1;
+  }
 }
 
+ehfloat reduce_identity(int op)
+{
+  if (op == EH_REDUCE_MIN)
+  {
+    return INFINITY;
+  }
+  if (op == EH_REDUCE_MAX)
+  {
+    return -INFINITY;
+  }
+  return 0;
+}
+ehfloat reduce_apply(int op, ehfloat a, ehfloat b)
+{
+  if (op == EH_REDUCE_MIN)
+  {
+    return min(a, b);
+  }
+  if (op == EH_REDUCE_MAX)
+  {
+    return max(a, b);
+  }
+  return a + b;
+}
+// tree reduction of temp[0..local_size) into temp[0]
+void reduce_local(int op, local ehfloat* temp)
+{
+  const int lid = get_local_id(0);
+  for (int s = get_local_size(0) >> 1; s > 0; s >>= 1)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s)
+    {
+      temp[lid] = reduce_apply(op, temp[lid], temp[lid + s]);
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+}
+// first pass: every work-group reduces a strided slice of A over particles
+// without any of exclude_flags set; A is ehvec3 unless element is
+// EH_REDUCE_SCALAR, or ehhalf3 for EH_REDUCE_HALF_LENGTH
+kernel void reduce_particles(constant struct constant_t* c,
+                             global const ehfloat* A,
+                             global const int* flags,
+                             int exclude_flags,
+                             int op,
+                             int element,
+                             global ehfloat* partial,
+                             local ehfloat* temp)
+{
+  ehfloat x = reduce_identity(op);
+  for (int i = get_global_id(0); i < c->N; i += get_global_size(0))
+  {
+    if (flags[i] & exclude_flags)
+    {
+      continue;
+    }
+    ehfloat a;
+    if (element == EH_REDUCE_COUNT)
+    {
+      a = 1;
+    }
+    else if (element == EH_REDUCE_SCALAR)
+    {
+      a = A[i];
+    }
+#ifdef EH_HALF
+    else if (element == EH_REDUCE_HALF_LENGTH)
+    {
+      a = length(EH_LOADH3((global const ehhalf3*)A, i));
+    }
+#endif
+    else
+    {
+      ehfloat3 v = EH_LOAD3((global const ehvec3*)A, i);
+      a = element == EH_REDUCE_LENGTH ? length(v) : dot(v, v);
+    }
+    x = reduce_apply(op, x, a);
+  }
+  temp[get_local_id(0)] = x;
+  reduce_local(op, temp);
+  if (get_local_id(0) == 0)
+  {
+    partial[get_group_id(0)] = temp[0];
+  }
+}
+// second pass in a single work-group: result[offset] = reduction of partial
+kernel void reduce_partial(global const ehfloat* partial,
+                           int N,
+                           int op,
+                           global ehfloat* result,
+                           int offset,
+                           local ehfloat* temp)
+{
+  ehfloat x = reduce_identity(op);
+  for (int i = get_local_id(0); i < N; i += get_local_size(0))
+  {
+    x = reduce_apply(op, x, partial[i]);
+  }
+  temp[get_local_id(0)] = x;
+  reduce_local(op, temp);
+  if (get_local_id(0) == 0)
+  {
+    result[offset] = temp[0];
+  }
+}
+
+// picks the next time step from the largest speed and acceleration of the
+// step just taken (extrema[0], extrema[1]); state holds (dt, time) and
+// history[slot] records the new dt. The result is copied into c->dt.
+kernel void update_dt(constant struct constant_t* c,
+                      global const ehfloat* extrema,
+                      global ehfloat* state,
+                      global ehfloat* history,
+                      int slot,
+                      ehfloat courant_factor,
+                      ehfloat force_factor,
+                      ehfloat sound_speed,
+                      ehfloat max_dt)
+{
+  const ehfloat vmax = extrema[0];
+  const ehfloat amax = extrema[1];
+  ehfloat dt = max_dt;
+  if (vmax + sound_speed > 0)
+  {
+    dt = min(dt, courant_factor * c->gap / (vmax + sound_speed));
+  }
+  if (amax > 0)
+  {
+    dt = min(dt, force_factor * sqrt(c->gap / amax));
+  }
+  // grow gradually; shrinking is immediate
+  dt = min(dt, (ehfloat)1.2 * c->dt);
+  state[1] += c->dt;
+  state[0] = dt;
+  history[slot] = dt;
+}
+
+// also the rate of change of the density from the continuity equation,
+// drho = sum_j m_j (v_i - v_j) . grad W_ij, which advect_phase1 uses to
+// predict the density after the move
 kernel void calculate_rho(constant struct constant_t* c,
                           global const int* neighbor_begin,
                           global const int* neighbors,
-                          global const ehfloat3* position,
+                          global const ehvec3* position,
+                          global const ehvec3* velocity,
                           global ehfloat* rho,
-                          global ehfloat* V,
+                          global ehfloat* drho,
+                          global ehhalf* V,
                           global const int* flags)
 {
   const int id = get_global_id(0);
@@ -220,41 +864,48 @@ kernel void calculate_rho(constant struct constant_t* c,
   {
     return;
   }
-  ehfloat density = 0;
-  ehfloat numdensity = 0;
-  for (int jj = neighbor_begin[id]; jj < neighbor_begin[id + 1]; ++jj)
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  const ehfloat3 vi = EH_LOAD3(velocity, id);
+  ehacc density = 0;
+  ehacc density_rate = 0;
+  ehacc numdensity = 0;
+  FOR_EACH_NEIGHBOR(j)
   {
-    int j = neighbors[jj];
-    ehfloat3 rij = position[id] - position[j];
-    ehfloat k = kernel_function(c->invH, rij);
-    if (flags[j] & EH_PARTICLE_STATIC)
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
     {
-      density += STATIC_MASS * c->mass * k;
+      continue;
     }
-    else
+    ehfloat k = kernel_function(EH_INVH, rij);
+    ehfloat mj = EH_MASS;
+    if (flags[j] & EH_PARTICLE_STATIC)
     {
-      density += c->mass * k;
+      mj *= STATIC_MASS;
     }
+    density += mj * k;
+    density_rate += mj
+                    * dot(vi - EH_LOAD3(velocity, j),
+                          kernel_gradient(EH_INVH, rij));
     numdensity += k;
   }
-  density = max(density, c->rho0);
-  rho[id] = density;
+  rho[id] = max((ehfloat)density, EH_RHO0);
+  drho[id] = density_rate;
   if (flags[id] & EH_PARTICLE_STATIC)
   {
-    V[id] = STATIC_MASS / numdensity;
+    EH_STORE_V(V, id, STATIC_MASS / numdensity);
   }
   else
   {
-    V[id] = 1.0 / numdensity;
+    EH_STORE_V(V, id, 1.0 / numdensity);
   }
 }
 ehfloat16 gradient_tensor(constant struct constant_t* c,
                           global const int* neighbor_begin,
                           global const int* neighbors,
 
-                          global const ehfloat3* position,
+                          global const ehvec3* position,
                           global const ehfloat* rho,
-                          global const ehfloat* V,
+                          global const ehhalf* V,
                           global const int* flags,
                           int id)
 {
@@ -262,11 +913,10 @@ ehfloat16 gradient_tensor(constant struct constant_t* c,
                      (ehfloat4)(0, 0, 1, 0), (ehfloat4)(0));
 
   ehfloat3 invB[3] = { (ehfloat3)(0), (ehfloat3)(0), (ehfloat3)(0) };
-  for (int jj = neighbor_begin[id]; jj < neighbor_begin[id + 1]; ++jj)
+  FOR_EACH_NEIGHBOR(j)
   {
-    int j = neighbors[jj];
-    ehfloat3 rij = position[id] - position[j];
-    ehfloat3 kdV = kernel_gradient(c->invH, rij) * V[j];
+    ehfloat3 rij = EH_LOAD3(position, id) - EH_LOAD3(position, j);
+    ehfloat3 kdV = kernel_gradient(EH_INVH, rij) * EH_LOAD_V(V, j);
     invB[0] += rij.x * kdV;
     invB[1] += rij.y * kdV;
     invB[2] += rij.z * kdV;
@@ -289,12 +939,12 @@ kernel void calculate_nonpressure_force(constant struct constant_t* c,
                                         global const int* neighbor_begin,
                                         global const int* neighbors,
 
-                                        global const ehfloat3* position,
+                                        global const ehvec3* position,
                                         global const ehfloat* rho,
-                                        global const ehfloat3* velocity,
+                                        global const ehvec3* velocity,
                                         global const int* flags,
-                                        global ehfloat3* nonpressure_force,
-                                        global const ehfloat* V)
+                                        global ehhalf3* nonpressure_force,
+                                        global const ehhalf* V)
 {
   const int id = get_global_id(0);
   if (id >= c->N)
@@ -305,43 +955,51 @@ kernel void calculate_nonpressure_force(constant struct constant_t* c,
   {
     return;
   }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  const ehfloat3 vi = EH_LOAD3(velocity, id);
 
   ehfloat3 gradvx = (ehfloat3)(0, 0, 0);
   ehfloat3 gradvy = (ehfloat3)(0, 0, 0);
   ehfloat3 gradvz = (ehfloat3)(0, 0, 0);
   ehfloat16 B = gradient_tensor(c, neighbor_begin, neighbors, position, rho, V,
                                 flags, id);
-  for (int jj = neighbor_begin[id]; jj < neighbor_begin[id + 1]; ++jj)
+  FOR_EACH_NEIGHBOR(j)
   {
-    int j = neighbors[jj];
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
     if (flags[j] & EH_PARTICLE_STATIC)
     {
       continue;
     }
-    ehfloat3 rij = position[id] - position[j];
-    ehfloat3 kdV = kernel_gradient(c->invH, rij) * V[j];
+    ehfloat3 kdV = kernel_gradient(EH_INVH, rij) * EH_LOAD_V(V, j);
     ehfloat3 BkdV = kdV.x * B.s012 + kdV.y * B.s456 + kdV.z * B.s89a;
-    ehfloat3 vji = velocity[j] - velocity[id];
+    ehfloat3 vji = EH_LOAD3(velocity, j) - vi;
     gradvx += vji.x * BkdV;
     gradvy += vji.y * BkdV;
     gradvz += vji.z * BkdV;
   }
 
   ehfloat3 lapv = (ehfloat3)(0, 0, 0);
-  for (int jj = neighbor_begin[id]; jj < neighbor_begin[id + 1]; ++jj)
+  FOR_EACH_NEIGHBOR(j)
   {
-    int j = neighbors[jj];
     if (j == id)
     {
       continue;
     }
+    ehfloat3 eij = xi - EH_LOAD3(position, j);
+    if (dot(eij, eij) > EH_H * EH_H)
+    {
+      continue;
+    }
     if (flags[j] & EH_PARTICLE_STATIC)
     {
       continue;
     }
-    ehfloat3 eij = position[id] - position[j];
-    ehfloat3 kdV = kernel_gradient(c->invH, eij) * V[j];
-    ehfloat3 vij = velocity[id] - velocity[j];
+    ehfloat3 kdV = kernel_gradient(EH_INVH, eij) * EH_LOAD_V(V, j);
+    ehfloat3 vij = vi - EH_LOAD3(velocity, j);
     if (dot(eij, eij) < 1e-10)
     {
       continue;
@@ -352,37 +1010,164 @@ kernel void calculate_nonpressure_force(constant struct constant_t* c,
         = (ehfloat3)(dot(gradvx, eij), dot(gradvy, eij), dot(gradvz, eij));
     lapv += 2 * (vij * invlen - edgu) * dot(eij, kdV);
   }
-  nonpressure_force[id] = rho[id] * c->gravity + c->mu * lapv;
+  EH_STOREH3(nonpressure_force, id, rho[id] * c->gravity + EH_MU * lapv);
+}
+#ifndef EH_GRID_HASH
+// Cell-centric calculate_nonpressure_force: work-group g takes the particles
+// of grid cell g, one work-group size at a time, and stages the 27
+// surrounding cells tile by tile in local memory, so a neighbor is read from
+// global memory once per group instead of once per particle. Needs
+// grid_beginpoint to match the particle order, i.e. no Verlet list reuse.
+// gradient_tensor currently returns the identity, which is used directly.
+kernel void calculate_nonpressure_force_tiled(constant struct constant_t* c,
+                                              global const int* grid_beginpoint,
+                                              global const ehvec3* position,
+                                              global const ehfloat* rho,
+                                              global const ehvec3* velocity,
+                                              global const int* flags,
+                                              global ehhalf3* nonpressure_force,
+                                              global const ehhalf* V,
+                                              local ehfloat3* tile_position,
+                                              local ehfloat3* tile_velocity,
+                                              local ehfloat* tile_V,
+                                              local int* tile_flags)
+{
+  const int cell = get_group_id(0);
+  const int lid = get_local_id(0);
+  const int cell_begin = grid_beginpoint[cell];
+  const int cell_end = grid_beginpoint[cell + 1];
+  const int3 i3 = index3_from_gridindex(c, cell);
+  const int3 lo = stencil_min(c, i3);
+  const int3 hi = stencil_max(c, i3);
+  for (int chunk = cell_begin; chunk < cell_end; chunk += get_local_size(0))
+  {
+    const int id = chunk + lid;
+    const bool active = id < cell_end && (flags[id] & EH_PARTICLE_STATIC) == 0;
+    const ehfloat3 xi = active ? EH_LOAD3(position, id) : (ehfloat3)(0);
+    const ehfloat3 vi = active ? EH_LOAD3(velocity, id) : (ehfloat3)(0);
+
+    ehfloat3 gradvx = (ehfloat3)(0, 0, 0);
+    ehfloat3 gradvy = (ehfloat3)(0, 0, 0);
+    ehfloat3 gradvz = (ehfloat3)(0, 0, 0);
+    FOR_EACH_TILE(t, n, lo, hi)
+    {
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if (lid < n)
+      {
+        tile_position[lid] = EH_LOAD3(position, t + lid);
+        tile_velocity[lid] = EH_LOAD3(velocity, t + lid);
+        tile_V[lid] = EH_LOAD_V(V, t + lid);
+        tile_flags[lid] = flags[t + lid];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for (int k = 0; active && k < n; ++k)
+      {
+        ehfloat3 rij = xi - tile_position[k];
+        if (dot(rij, rij) > EH_H * EH_H)
+        {
+          continue;
+        }
+        if (tile_flags[k] & EH_PARTICLE_STATIC)
+        {
+          continue;
+        }
+        ehfloat3 kdV = kernel_gradient(EH_INVH, rij) * tile_V[k];
+        ehfloat3 vji = tile_velocity[k] - vi;
+        gradvx += vji.x * kdV;
+        gradvy += vji.y * kdV;
+        gradvz += vji.z * kdV;
+      }
+    }
+
+    ehfloat3 lapv = (ehfloat3)(0, 0, 0);
+    FOR_EACH_TILE(t, n, lo, hi)
+    {
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if (lid < n)
+      {
+        tile_position[lid] = EH_LOAD3(position, t + lid);
+        tile_velocity[lid] = EH_LOAD3(velocity, t + lid);
+        tile_V[lid] = EH_LOAD_V(V, t + lid);
+        tile_flags[lid] = flags[t + lid];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for (int k = 0; active && k < n; ++k)
+      {
+        if (t + k == id)
+        {
+          continue;
+        }
+        ehfloat3 eij = xi - tile_position[k];
+        if (dot(eij, eij) > EH_H * EH_H)
+        {
+          continue;
+        }
+        if (tile_flags[k] & EH_PARTICLE_STATIC)
+        {
+          continue;
+        }
+        ehfloat3 kdV = kernel_gradient(EH_INVH, eij) * tile_V[k];
+        ehfloat3 vij = vi - tile_velocity[k];
+        if (dot(eij, eij) < 1e-10)
+        {
+          continue;
+        }
+        ehfloat invlen = 1.0 / length(eij);
+        eij = normalize(eij);
+        ehfloat3 edgu = (ehfloat3)(dot(gradvx, eij), dot(gradvy, eij),
+                                   dot(gradvz, eij));
+        lapv += 2 * (vij * invlen - edgu) * dot(eij, kdV);
+      }
+    }
+    if (active)
+    {
+      EH_STOREH3(nonpressure_force, id, rho[id] * c->gravity + EH_MU * lapv);
+    }
+  }
 }
+#endif
 
+// p / rho^2 of the Tait equation, the only form calculate_pressure_force
+// needs; static particles take the boundary pressure EH_STATIC_PRESSURE,
+// fixed at build time
+ehfloat pressure_rho2(constant struct constant_t* c, ehfloat rho, int flags)
+{
+  ehfloat p = EH_STATIC_PRESSURE;
+  if ((flags & EH_PARTICLE_STATIC) == 0)
+  {
+#ifdef EH_GAMMA_INT
+    // integer exponent; a few multiplications instead of exp/log
+    p = EH_PRESSURE0 * (pown(rho / EH_RHO0, EH_GAMMA_INT) - 1.0);
+#else
+    p = EH_PRESSURE0 * (pow(rho / EH_RHO0, EH_GAMMA) - 1.0);
+#endif
+  }
+  return p / (rho * rho);
+}
+// only needed when the density is re-evaluated after advect_phase1, which
+// otherwise computes p / rho^2 along with the predicted density
 kernel void calculate_pressure(constant struct constant_t* c,
                                global const ehfloat* rho,
                                global const int* flags,
-                               global ehfloat* pressure)
+                               global ehhalf* pressure_rho2_out)
 {
   int id = get_global_id(0);
   if (id >= c->N)
   {
     return;
   }
-  pressure[id] = c->Cs * c->Cs * c->rho0 / c->gamma
-                 * (pow(rho[id] / c->rho0, c->gamma) - 1.0);
-  if (flags[id] & EH_PARTICLE_STATIC)
-  {
-    pressure[id] = c->Cs * c->Cs * c->rho0 / c->gamma
-                   * (pow(c->static_rho, c->gamma) - 1.0);
-  }
+  EH_STOREH(pressure_rho2_out, id, pressure_rho2(c, rho[id], flags[id]));
 }
 kernel void calculate_pressure_force(constant struct constant_t* c,
                                      global const int* neighbor_begin,
                                      global const int* neighbors,
 
-                                     global const ehfloat3* position,
+                                     global const ehvec3* position,
                                      global const ehfloat* rho,
-                                     global const ehfloat* pressure,
+                                     global const ehhalf* pressure_rho2,
                                      global const int* flags,
-                                     global ehfloat3* pressure_force,
-                                     global const ehfloat* V)
+                                     global ehvec3* pressure_force,
+                                     global const ehhalf* V)
 {
   int id = get_global_id(0);
   if (id >= c->N)
@@ -393,6 +1178,7 @@ kernel void calculate_pressure_force(constant struct constant_t* c,
   {
     return;
   }
+  const ehfloat3 xi = EH_LOAD3(position, id);
 
   /*
     ehfloat16 B =
@@ -401,59 +1187,138 @@ kernel void calculate_pressure_force(constant struct constant_t* c,
     for( int jj=neighbor_begin[id]; jj<neighbor_begin[id+1]; ++jj )
     {
       int j = neighbors[jj];
-      ehfloat3 rij = position[id] - position[j];
-      ehfloat3 kdV = kernel_gradient(c->invH,rij)*V[j];
+      ehfloat3 rij = xi - EH_LOAD3(position, j);
+      ehfloat3 kdV = kernel_gradient(EH_INVH,rij)*V[j];
       ehfloat3 BkdV = kdV.x*B.s012 + kdV.y*B.s456 + kdV.z*B.s89a;
       force -= (pressure[j]-pressure[id])*BkdV;
     }
   */
-  ehfloat3 accel = (ehfloat3)(0, 0, 0);
-  for (int jj = neighbor_begin[id]; jj < neighbor_begin[id + 1]; ++jj)
-  {
-    int j = neighbors[jj];
-    ehfloat3 rij = position[id] - position[j];
-    ehfloat3 acc = -kernel_gradient(c->invH, rij) * c->mass
-                   * (pressure[id] / (rho[id] * rho[id])
-                      + pressure[j] / (rho[j] * rho[j]));
+  ehacc3 accel = (ehacc3)(0, 0, 0);
+  const ehfloat pi = EH_LOADH(pressure_rho2, id);
+  FOR_EACH_NEIGHBOR(j)
+  {
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
+    ehfloat3 acc = -kernel_gradient(EH_INVH, rij) * EH_MASS
+                   * (pi + EH_LOADH(pressure_rho2, j));
     if (flags[j] & EH_PARTICLE_STATIC)
     {
       acc *= STATIC_MASS;
     }
 
-    accel += acc;
+    accel += EH_ACC3(acc);
   }
 
-  pressure_force[id] = accel * rho[id];
+  EH_STORE3(pressure_force, id, EH_FROM_ACC3(accel) * rho[id]);
+}
+#ifndef EH_GRID_HASH
+// cell-centric calculate_pressure_force, organized like
+// calculate_nonpressure_force_tiled
+kernel void calculate_pressure_force_tiled(constant struct constant_t* c,
+                                           global const int* grid_beginpoint,
+                                           global const ehvec3* position,
+                                           global const ehfloat* rho,
+                                           global const ehhalf* pressure_rho2,
+                                           global const int* flags,
+                                           global ehvec3* pressure_force,
+                                           local ehfloat3* tile_position,
+                                           local ehfloat* tile_pressure,
+                                           local int* tile_flags)
+{
+  const int cell = get_group_id(0);
+  const int lid = get_local_id(0);
+  const int cell_begin = grid_beginpoint[cell];
+  const int cell_end = grid_beginpoint[cell + 1];
+  const int3 i3 = index3_from_gridindex(c, cell);
+  const int3 lo = stencil_min(c, i3);
+  const int3 hi = stencil_max(c, i3);
+  for (int chunk = cell_begin; chunk < cell_end; chunk += get_local_size(0))
+  {
+    const int id = chunk + lid;
+    const bool active = id < cell_end && (flags[id] & EH_PARTICLE_STATIC) == 0;
+    const ehfloat3 xi = active ? EH_LOAD3(position, id) : (ehfloat3)(0);
+    const ehfloat pi = active ? EH_LOADH(pressure_rho2, id) : 0;
+
+    ehacc3 accel = (ehacc3)(0, 0, 0);
+    FOR_EACH_TILE(t, n, lo, hi)
+    {
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if (lid < n)
+      {
+        tile_position[lid] = EH_LOAD3(position, t + lid);
+        tile_pressure[lid] = EH_LOADH(pressure_rho2, t + lid);
+        tile_flags[lid] = flags[t + lid];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+      for (int k = 0; active && k < n; ++k)
+      {
+        ehfloat3 rij = xi - tile_position[k];
+        if (dot(rij, rij) > EH_H * EH_H)
+        {
+          continue;
+        }
+        ehfloat3 acc = -kernel_gradient(EH_INVH, rij) * EH_MASS
+                       * (pi + tile_pressure[k]);
+        if (tile_flags[k] & EH_PARTICLE_STATIC)
+        {
+          acc *= STATIC_MASS;
+        }
+        accel += EH_ACC3(acc);
+      }
+    }
+    if (active)
+    {
+      EH_STORE3(pressure_force, id, EH_FROM_ACC3(accel) * rho[id]);
+    }
+  }
 }
+#endif
 
 kernel void advect_phase1(constant struct constant_t* c,
                           global const int* flags,
-                          global const ehfloat3* svelocity,
-                          global ehfloat3* position,
-                          global ehfloat3* velocity,
-                          global const ehfloat* rho,
-                          global const ehfloat3* nonpressure_force)
+                          global const ehvec3* svelocity,
+                          global ehvec3* position,
+                          global ehvec3* velocity,
+                          global ehfloat* rho,
+                          global const ehfloat* drho,
+                          global ehhalf* pressure_rho2_out,
+                          global ehhalf3* nonpressure_force)
 {
   int id = get_global_id(0);
   if (id >= c->N)
   {
     return;
   }
+  const ehfloat rho_t = rho[id];
+  // density after the move, first order in dt; replaces a second
+  // calculate_rho sweep, and with it the calculate_pressure launch
+  const ehfloat rho_new = max(rho_t + c->dt * drho[id], EH_RHO0);
+  rho[id] = rho_new;
+  EH_STOREH(pressure_rho2_out, id, pressure_rho2(c, rho_new, flags[id]));
   if (flags[id] & EH_PARTICLE_STATIC)
   {
     return;
   }
-  ehfloat3 accel = nonpressure_force[id] / rho[id];
-  position[id] += c->dt * velocity[id] + 0.5 * c->dt * c->dt * accel;
-  velocity[id] += c->dt * accel;
+  ehfloat3 accel = EH_LOADH3(nonpressure_force, id) / rho_t;
+  const ehfloat3 v = EH_LOAD3(velocity, id);
+  EH_STORE3(position, id,
+            EH_LOAD3(position, id) + c->dt * v + 0.5 * c->dt * c->dt * accel);
+  EH_STORE3(velocity, id, v + c->dt * accel);
+  // nonpressure_force now holds the acceleration; advect_phase2 adds the
+  // pressure part for the time step criterion
+  EH_STOREH3(nonpressure_force, id, accel);
 }
 kernel void advect_phase2(constant struct constant_t* c,
                           global const int* flags,
-                          global const ehfloat3* svelocity,
-                          global ehfloat3* position,
-                          global ehfloat3* velocity,
+                          global const ehvec3* svelocity,
+                          global ehvec3* position,
+                          global ehvec3* velocity,
                           global const ehfloat* rho,
-                          global const ehfloat3* pressure_force)
+                          global const ehvec3* pressure_force,
+                          global ehhalf3* acceleration)
 {
   int id = get_global_id(0);
   if (id >= c->N)
@@ -464,58 +1329,310 @@ kernel void advect_phase2(constant struct constant_t* c,
   {
     return;
   }
-  const ehfloat3 accel = pressure_force[id] / rho[id];
-  position[id] += 0.5 * c->dt * c->dt * accel;
-  velocity[id] += c->dt * accel;
+  const ehfloat3 accel = EH_LOAD3(pressure_force, id) / rho[id];
+  EH_STORE3(position, id,
+            EH_LOAD3(position, id) + 0.5 * c->dt * c->dt * accel);
+  EH_STORE3(velocity, id, EH_LOAD3(velocity, id) + c->dt * accel);
+  EH_STOREH3(acceleration, id, EH_LOADH3(acceleration, id) + accel);
+}
+
+// IISPH (Ihmsen et al. 2014) pressure solve. The step runs calculate_rho,
+// calculate_nonpressure_force, iisph_predict and iisph_setup, then iterates
+// iisph_pressure_accel / iisph_update_pressure until iisph_check marks
+// state[3] converged, and moves the particles with iisph_integrate.
+// state : (fluid count, error sum, iterations, converged,
+//          total iterations, steps, max error, last error)
+// Static particles act as boundary with mirrored pressure.
+
+// v_adv = v + dt * nonpressure acceleration; positions stay at time t
+kernel void iisph_predict(constant struct constant_t* c,
+                          global const int* flags,
+                          global ehvec3* velocity,
+                          global const ehfloat* rho,
+                          global ehhalf3* nonpressure_force)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  if (flags[id] & EH_PARTICLE_STATIC)
+  {
+    return;
+  }
+  const ehfloat3 accel = EH_LOADH3(nonpressure_force, id) / rho[id];
+  EH_STORE3(velocity, id, EH_LOAD3(velocity, id) + c->dt * accel);
+  // kept as acceleration for update_dt, like advect_phase1
+  EH_STOREH3(nonpressure_force, id, accel);
+}
+// diagonal a_ii of the pressure system and source term rho0 - rho_adv;
+// the previous pressure, halved, is the initial guess
+kernel void iisph_setup(constant struct constant_t* c,
+                        global const int* neighbor_begin,
+                        global const int* neighbors,
+                        global const ehvec3* position,
+                        global const ehvec3* velocity,
+                        global const ehfloat* rho,
+                        global const int* flags,
+                        global ehfloat* pressure,
+                        global ehfloat* aii,
+                        global ehfloat* source)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  if (flags[id] & EH_PARTICLE_STATIC)
+  {
+    return;
+  }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  const ehfloat3 vi = EH_LOAD3(velocity, id);
+  const ehfloat dt2 = c->dt * c->dt;
+  const ehfloat inv_rho2 = 1.0 / (rho[id] * rho[id]);
+
+  ehfloat3 dii = (ehfloat3)(0, 0, 0);
+  FOR_EACH_NEIGHBOR(j)
+  {
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
+    ehfloat mj = EH_MASS;
+    if (flags[j] & EH_PARTICLE_STATIC)
+    {
+      mj *= STATIC_MASS;
+    }
+    dii -= dt2 * mj * inv_rho2 * kernel_gradient(EH_INVH, rij);
+  }
+
+  ehacc a = 0;
+  ehacc drho = 0;
+  FOR_EACH_NEIGHBOR(j)
+  {
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
+    const ehfloat3 grad = kernel_gradient(EH_INVH, rij);
+    if (flags[j] & EH_PARTICLE_STATIC)
+    {
+      const ehfloat mj = STATIC_MASS * EH_MASS;
+      a += mj * dot(dii, grad);
+      drho += mj * dot(vi - EH_LOAD3(velocity, j), grad);
+    }
+    else
+    {
+      // d_ji, the displacement of j caused by the pressure of id
+      const ehfloat3 dji = dt2 * EH_MASS * inv_rho2 * grad;
+      a += EH_MASS * dot(dii - dji, grad);
+      drho += EH_MASS * dot(vi - EH_LOAD3(velocity, j), grad);
+    }
+  }
+  aii[id] = a;
+  source[id] = EH_RHO0 - (rho[id] + c->dt * drho);
+  pressure[id] *= 0.5;
+}
+// pressure acceleration of the current iterate into accel; skipped once
+// converged unless skip_converged is 0
+kernel void iisph_pressure_accel(constant struct constant_t* c,
+                                 global const int* neighbor_begin,
+                                 global const int* neighbors,
+                                 global const ehvec3* position,
+                                 global const ehfloat* rho,
+                                 global const ehfloat* pressure,
+                                 global const int* flags,
+                                 global ehvec3* accel,
+                                 global const ehfloat* state,
+                                 int skip_converged)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  if (skip_converged && state[3] != 0)
+  {
+    return;
+  }
+  if (flags[id] & EH_PARTICLE_STATIC)
+  {
+    EH_STORE3(accel, id, (ehfloat3)(0, 0, 0));
+    return;
+  }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  const ehfloat pi = pressure[id] / (rho[id] * rho[id]);
+  ehacc3 a = (ehacc3)(0, 0, 0);
+  FOR_EACH_NEIGHBOR(j)
+  {
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
+    const ehfloat3 grad = kernel_gradient(EH_INVH, rij);
+    if (flags[j] & EH_PARTICLE_STATIC)
+    {
+      a -= EH_ACC3(STATIC_MASS * EH_MASS * pi * grad);
+    }
+    else
+    {
+      a -= EH_ACC3(EH_MASS * (pi + pressure[j] / (rho[j] * rho[j])) * grad);
+    }
+  }
+  EH_STORE3(accel, id, EH_FROM_ACC3(a));
+}
+// one relaxed Jacobi update of the pressure; error is the remaining
+// relative density error of each compressed particle
+kernel void iisph_update_pressure(constant struct constant_t* c,
+                                  global const int* neighbor_begin,
+                                  global const int* neighbors,
+                                  global const ehvec3* position,
+                                  global const int* flags,
+                                  global const ehvec3* accel,
+                                  global const ehfloat* aii,
+                                  global const ehfloat* source,
+                                  global ehfloat* pressure,
+                                  global ehfloat* error,
+                                  global const ehfloat* state,
+                                  ehfloat omega)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  if (state[3] != 0)
+  {
+    return;
+  }
+  if (flags[id] & EH_PARTICLE_STATIC)
+  {
+    return;
+  }
+  const ehfloat3 xi = EH_LOAD3(position, id);
+  const ehfloat3 ai = EH_LOAD3(accel, id);
+  ehacc Ap = 0;
+  FOR_EACH_NEIGHBOR(j)
+  {
+    ehfloat3 rij = xi - EH_LOAD3(position, j);
+    if (dot(rij, rij) > EH_H * EH_H)
+    {
+      continue;
+    }
+    const ehfloat3 grad = kernel_gradient(EH_INVH, rij);
+    if (flags[j] & EH_PARTICLE_STATIC)
+    {
+      Ap += STATIC_MASS * EH_MASS * dot(ai, grad);
+    }
+    else
+    {
+      Ap += EH_MASS * dot(ai - EH_LOAD3(accel, j), grad);
+    }
+  }
+  Ap *= c->dt * c->dt;
+
+  ehfloat p = 0;
+  if (fabs(aii[id]) > 1e-9)
+  {
+    p = max((ehfloat)(pressure[id] + omega * (source[id] - Ap) / aii[id]),
+            (ehfloat)0);
+  }
+  pressure[id] = p;
+  error[id] = p > 0 ? (Ap - source[id]) / EH_RHO0 : 0;
+}
+// counts the iteration and sets the converged flag once the mean error of
+// the fluid is below tolerance
+kernel void iisph_check(global ehfloat* state,
+                        ehfloat tolerance,
+                        int min_iterations)
+{
+  if (state[3] != 0)
+  {
+    return;
+  }
+  state[2] += 1;
+  const ehfloat error = state[1] / max(state[0], (ehfloat)1);
+  state[7] = error;
+  if (state[2] >= min_iterations && error <= tolerance)
+  {
+    state[3] = 1;
+  }
+}
+// accumulate the statistics of this step
+kernel void iisph_finish(global ehfloat* state)
+{
+  state[4] += state[2];
+  state[5] += 1;
+  state[6] = max(state[6], state[7]);
+}
+// symplectic Euler with the final pressure acceleration; nonpressure_force
+// holds the nonpressure acceleration and is completed to the total
+kernel void iisph_integrate(constant struct constant_t* c,
+                            global const int* flags,
+                            global ehvec3* position,
+                            global ehvec3* velocity,
+                            global const ehvec3* accel,
+                            global ehhalf3* acceleration)
+{
+  const int id = get_global_id(0);
+  if (id >= c->N)
+  {
+    return;
+  }
+  if (flags[id] & EH_PARTICLE_STATIC)
+  {
+    return;
+  }
+  const ehfloat3 a = EH_LOAD3(accel, id);
+  const ehfloat3 v = EH_LOAD3(velocity, id) + c->dt * a;
+  EH_STORE3(velocity, id, v);
+  EH_STORE3(position, id, EH_LOAD3(position, id) + c->dt * v);
+  EH_STOREH3(acceleration, id, EH_LOADH3(acceleration, id) + a);
 }
 
 ehfloat calculate_rho_at(constant struct constant_t* c,
                          global const int* grid_beginpoint,
 
-                         global const ehfloat3* position,
+                         global const ehvec3* position,
                          global ehfloat* rho,
-                         global ehfloat* V,
+                         global ehhalf* V,
                          global const int* flags,
                          ehfloat3 point,
                          int except_flag)
 {
   int3 index3 = gridindex3_from_p3(c, point);
-  int3 mingrid = max(index3 - 1, 0);
-  int3 maxgrid = min(index3 + 1, c->gridsize - 1);
+  int3 mingrid = stencil_min(c, index3);
+  int3 maxgrid = stencil_max(c, index3);
 
   ehfloat density = 0;
-  for (int gridz = mingrid.z; gridz <= maxgrid.z; ++gridz)
+  FOR_EACH_CELL_RANGE(begin, end, grid_beginpoint, mingrid, maxgrid)
   {
-    for (int gridy = mingrid.y; gridy <= maxgrid.y; ++gridy)
+    for (int j = begin; j < end; ++j)
     {
-      int begin = grid_beginpoint[gridindex_from_index3(
-          c, (int3)(mingrid.x, gridy, gridz))];
-      int end = grid_beginpoint[gridindex_from_index3(
-                                    c, (int3)(maxgrid.x, gridy, gridz))
-                                + 1];
-      for (int j = begin; j < end; ++j)
+      ehfloat3 rij = point - EH_LOAD3(position, j);
+      if (dot(rij, rij) > EH_H * EH_H)
       {
-        ehfloat3 rij = point - position[j];
-        if (dot(rij, rij) > c->H * c->H)
-        {
-          continue;
-        }
-        if (flags[j] & except_flag)
-        {
-          continue;
-        }
-        ehfloat k = kernel_function(c->invH, rij);
-        density += k * c->mass;
+        continue;
+      }
+      if (flags[j] & except_flag)
+      {
+        continue;
       }
+      ehfloat k = kernel_function(EH_INVH, rij);
+      density += k * EH_MASS;
     }
   }
   return density;
 }
 kernel void get_image(constant struct constant_t* c,
                       global const int* grid_beginpoint,
-                      global ehfloat3* position,
+                      global ehvec3* position,
                       global const ehfloat* rho,
-                      global ehfloat* V,
+                      global ehhalf* V,
                       global const int* flags,
                       global ehfloat* image,
                       ehfloat3 r0,
@@ -1,5 +1,8 @@
 #include "MC33.h"
 #include "engine.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 
 engine_t engine;
@@ -27,6 +30,49 @@ int main()
   param.courant_dt_factor = 0.8;
   param.diffusion_dt_factor = 0.8;
   param.rho0 = 1;
+  // only wait for the device when a frame is written
+  param.sync_interval = 0;
+  // SPH_GRID_ORDER=morton to compare cell orderings
+  char const* grid_order = std::getenv("SPH_GRID_ORDER");
+  param.morton_grid = grid_order && std::strcmp(grid_order, "morton") == 0;
+  // SPH_PROFILE=1 for a per-kernel timing table, SPH_PROFILE_TRACE=file.json
+  // to also write a Chrome trace
+  char const* profile = std::getenv("SPH_PROFILE");
+  char const* profile_trace = std::getenv("SPH_PROFILE_TRACE");
+  param.profile = (profile && std::strcmp(profile, "1") == 0) || profile_trace;
+  if (profile_trace)
+  {
+    param.profile_trace = profile_trace;
+  }
+  // SPH_DEVICE=cpu|gpu|<index>|<name> to pick the OpenCL device
+  char const* device = std::getenv("SPH_DEVICE");
+  if (device)
+  {
+    param.device = device;
+  }
+  // SPH_SPECIALIZE=1 to compare the specialized program against the generic
+  char const* specialize = std::getenv("SPH_SPECIALIZE");
+  param.specialize = specialize && std::strcmp(specialize, "1") == 0;
+  // SPH_FORCES=tiled for the cell-tiled force kernels, auto to time both
+  char const* forces = std::getenv("SPH_FORCES");
+  param.tiled_forces = forces && std::strcmp(forces, "tiled") == 0;
+  param.tune_forces = forces && std::strcmp(forces, "auto") == 0;
+  // SPH_ADAPTIVE_DT=1 to let the device choose dt every step
+  char const* adaptive = std::getenv("SPH_ADAPTIVE_DT");
+  param.adaptive_dt = adaptive && std::strcmp(adaptive, "1") == 0;
+  // SPH_PRESSURE_SOLVER=iisph for the implicit incompressible solver
+  char const* solver = std::getenv("SPH_PRESSURE_SOLVER");
+  param.iisph = solver && std::strcmp(solver, "iisph") == 0;
+  if (param.iisph)
+  {
+    // dt is no longer bound by the speed of sound
+    param.max_dt_factor = 25;
+  }
+  if (param.adaptive_dt)
+  {
+    // engine.time and engine.dt are refreshed on sync()
+    param.sync_interval = 16;
+  }
   engine.set(param);
   engine.load_opencl();
   // engine.dt = 1.0/1500.0;
@@ -90,37 +136,50 @@ int main()
                             sizeof(ehfloat) * X * Y * Z);
 
   ehfloat t = 0;
-  int renderstep0 = 0.02 / engine.dt;
-  int renderstep = 0;
+  ehfloat frame_time = 0.02;
+  ehfloat next_frame = 0;
   std::ofstream file("vertices.dat");
   grid3d grid;
   std::vector<ehfloat> image(X * Y * Z);
   MC33 mc33;
   surface surf;
-  std::cout << "t\tN\tnverts\tntri\n";
+  std::cout << "t\tN\tnverts\tntri\tvmax\tdt";
+  if (engine.iisph)
+  {
+    std::cout << "\titer\trhoerr";
+  }
+  std::cout << "\n";
   std::cout << "---------------------------------------\n";
-  while (t < 20)
+  auto begin = std::chrono::steady_clock::now();
+  int steps = 0;
+  while (engine.time < 20)
   {
+    ++steps;
     engine.step();
-    t += engine.dt;
 
-    if (renderstep == 0)
+    if (engine.time >= next_frame)
     {
-      renderstep = renderstep0;
+      next_frame += frame_time;
+      engine.sync();
+      t = engine.time;
 
       // print marching cubes
       int err;
-      get_image_kernel(cl::EnqueueArgs(engine.queue, cl::NDRange(X, Y, Z)),
-                       engine.constant_buffer, engine.grid_particlecount,
-                       engine.position, engine.rho, engine.V, engine.flags,
-                       image_buffer, engine.minbound, engine.maxbound,
-                       // cl_float3{-0.1f,-0.1f,-0.1f},
-                       // cl_float3{2.1f,1.1f,1.1f},
-                       X, Y, Z, err)
-          .wait();
+      cl::Event image_event = get_image_kernel(
+          cl::EnqueueArgs(engine.queue, cl::NDRange(X, Y, Z)),
+          engine.constant_buffer, engine.grid_particlecount, engine.position,
+          engine.rho, engine.V, engine.flags, image_buffer, engine.minbound,
+          engine.maxbound,
+          // cl_float3{-0.1f,-0.1f,-0.1f},
+          // cl_float3{2.1f,1.1f,1.1f},
+          X, Y, Z, err);
+      engine.profile(image_event, "get_image");
+      image_event.wait();
       engine.check_kernel_error(err, "get_image_kernel");
       engine.queue.enqueueReadBuffer(image_buffer, CL_TRUE, 0,
-                                     sizeof(ehfloat) * X * Y * Z, image.data());
+                                     sizeof(ehfloat) * X * Y * Z, image.data(),
+                                     nullptr,
+                                     engine.profile_event("read image"));
       grid.set_data_pointer(X, Y, Z, image.data());
       grid.set_ratio_aspect(
           (engine.maxbound.s[0] - engine.minbound.s[0]) / (float)X,
@@ -145,7 +204,13 @@ int main()
       file.write((char*)ts, sizeof(unsigned int) * 3 * ntri);
       file.flush();
       std::cout << t << "\t" << engine.N << "\t" << nverts << "\t" << ntri
-                << "\n";
+                << "\t" << engine.max_velocity() << "\t" << engine.dt;
+      if (engine.iisph)
+      {
+        std::cout << "\t" << engine.iisph_stats.iterations << "\t"
+                  << engine.iisph_stats.density_error;
+      }
+      std::cout << "\n";
 
       // print particle position & velocity
       /*
@@ -171,8 +236,20 @@ int main()
       file.write( (char*)vel.data(), sizeof(ehfloat3)*N );
       */
     }
-    --renderstep;
   }
 
   engine.step();
+  engine.sync();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+  std::cout << (engine.morton_grid ? "morton" : "row-major") << " "
+            << (engine.specialize ? "specialized" : "generic") << " : "
+            << 1000.0 * seconds / steps << " ms/step\n";
+  std::cout << "program load : " << engine.program_build_ms << " ms ("
+            << (engine.program_cached ? "cached binary" : "built from source")
+            << ")\n";
+  engine.log_neighbor_locality();
+  engine.log_stats();
+  engine.log_profile();
 }
@@ -0,0 +1,769 @@
+#include "native_engine.hpp"
+#include <cmath>
+#include <numeric>
+
+thread_pool_t::thread_pool_t(int threads)
+{
+  for (int i = 1; i < threads; ++i)
+  {
+    workers.emplace_back([this] { work(); });
+  }
+}
+thread_pool_t::~thread_pool_t()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+  for (std::thread& worker : workers)
+  {
+    worker.join();
+  }
+}
+void thread_pool_t::run_blocks()
+{
+  for (int block = next_block++; block < job_blocks; block = next_block++)
+  {
+    (*job)(block);
+  }
+}
+void thread_pool_t::parallel_for(int blocks,
+                                 std::function<void(int)> const& f)
+{
+  if (workers.empty() || blocks <= 1)
+  {
+    for (int block = 0; block < blocks; ++block)
+    {
+      f(block);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &f;
+    job_blocks = blocks;
+    next_block = 0;
+    busy = (int)workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+  run_blocks();
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return busy == 0; });
+  job = nullptr;
+}
+void thread_pool_t::work()
+{
+  long seen = 0;
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return quit || generation != seen; });
+      if (quit)
+      {
+        return;
+      }
+      seen = generation;
+    }
+    run_blocks();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--busy == 0)
+    {
+      done.notify_one();
+    }
+  }
+}
+
+void native_engine_t::particles_t::resize(int n)
+{
+  for (auto* a : { &px, &py, &pz, &vx, &vy, &vz, &svx, &svy, &svz })
+  {
+    a->resize(n);
+  }
+  flags.resize(n);
+  color.resize(n);
+}
+
+void native_engine_t::set(param_t& param)
+{
+  if (param.iisph || param.adaptive_dt)
+  {
+    throw std::runtime_error(
+        "native backend: iisph and adaptive_dt are not supported");
+  }
+  max_particle_count = param.max_particle_count;
+  N = 0;
+  step_count = 0;
+  time = 0;
+  H = param.h;
+  invH = 1.0 / H;
+  gap = H / param.eta;
+  mu = param.mu;
+  rho0 = param.rho0;
+  gamma = param.gamma;
+  pressure0 = param.Cs * param.Cs * rho0 / gamma;
+  static_pressure = pressure0 * (std::pow(param.static_rho, gamma) - 1.0);
+  mass = rho0 * gap * gap * gap;
+  poly6_norm = 315.0 / (64.0 * M_PI) * invH * invH * invH;
+  poly6_grad_norm = -945.0 / (32.0 * M_PI) * invH * invH * invH * invH * invH;
+
+  // same fixed dt as engine_t::set
+  ehfloat courant_dt = param.courant_dt_factor * gap / param.Cs;
+  ehfloat diffusion_dt = 100000;
+  if (mu > 0)
+  {
+    diffusion_dt = param.diffusion_dt_factor * gap * gap / mu;
+  }
+  dt = std::min(courant_dt, diffusion_dt);
+
+  gridH = H * (1 + param.neighbor_skin);
+  gridinvH = 1.0 / gridH;
+  gridcells = 1;
+  for (int i = 0; i < 3; ++i)
+  {
+    minbound[i] = param.minbound.s[i];
+    gravity[i] = param.gravity.s[i];
+    gridsize[i] = (int)std::ceil((param.maxbound.s[i] - param.minbound.s[i])
+                                 * gridinvH);
+    gridcells *= gridsize[i];
+  }
+  thread_count = param.threads > 0 ? param.threads
+                                   : (int)std::thread::hardware_concurrency();
+  thread_count = std::max(thread_count, 1);
+  half_neighbors = param.half_neighbors;
+  predicted_density = param.predicted_density;
+}
+void native_engine_t::load()
+{
+  int n = max_particle_count;
+  particles.resize(n);
+  pong.resize(n);
+  for (auto* a : { &rho, &drho, &V, &pressure_rho2, &fx, &fy, &fz, &ax, &ay,
+                   &az })
+  {
+    a->assign(n, 0);
+  }
+  cellindex.resize(n);
+  sort_order.resize(n);
+  neighbor_begin.resize(n + 1);
+  grid_begin.resize(gridcells + 2);
+  pool = std::make_unique<thread_pool_t>(thread_count);
+  if (half_neighbors)
+  {
+    for (auto& sum : pair_sum)
+    {
+      sum.assign(n, 0);
+    }
+    gradv.assign(9 * n, 0);
+    // two cells of a color are at least three cells apart in some axis, so
+    // their 3x3x3 stencils do not overlap
+    colored_cells.clear();
+    color_begin.assign(28, 0);
+    for (int c = 0; c < 27; ++c)
+    {
+      color_begin[c] = (int)colored_cells.size();
+      for (int z = c / 9; z < gridsize[2]; z += 3)
+      {
+        for (int y = c / 3 % 3; y < gridsize[1]; y += 3)
+        {
+          for (int x = c % 3; x < gridsize[0]; x += 3)
+          {
+            colored_cells.push_back((z * gridsize[1] + y) * gridsize[0] + x);
+          }
+        }
+      }
+    }
+    color_begin[27] = (int)colored_cells.size();
+  }
+}
+void native_engine_t::add_particle(particle_info_t const& info)
+{
+  if (N >= max_particle_count)
+  {
+    throw std::runtime_error("particle count full error");
+  }
+  particles_t& p = particles;
+  p.px[N] = info.position.s[0];
+  p.py[N] = info.position.s[1];
+  p.pz[N] = info.position.s[2];
+  p.vx[N] = info.velocity.s[0];
+  p.vy[N] = info.velocity.s[1];
+  p.vz[N] = info.velocity.s[2];
+  p.svx[N] = info.svelocity.s[0];
+  p.svy[N] = info.svelocity.s[1];
+  p.svz[N] = info.svelocity.s[2];
+  p.flags[N] = info.flag;
+  p.color[N] = info.color;
+  ++N;
+}
+void native_engine_t::calculate_mass()
+{
+  grid_sort();
+  make_neighbors();
+  calculate_rho();
+  ehfloat maxrho = 0;
+  for (int i = 0; i < N; ++i)
+  {
+    if ((particles.flags[i] & EH_PARTICLE_STATIC) == 0)
+    {
+      maxrho = std::max(maxrho, rho[i]);
+    }
+  }
+  mass *= rho0 / maxrho;
+  std::cout << "Mass : " << mass << "\n";
+}
+void native_engine_t::read_particles(std::vector<ehfloat3>& position,
+                                     std::vector<ehfloat3>& velocity,
+                                     std::vector<ehfloat>& rho_out,
+                                     std::vector<cl_int>& flags)
+{
+  particles_t& p = particles;
+  position.resize(N);
+  velocity.resize(N);
+  for (int i = 0; i < N; ++i)
+  {
+    position[i] = { p.px[i], p.py[i], p.pz[i] };
+    velocity[i] = { p.vx[i], p.vy[i], p.vz[i] };
+  }
+  rho_out.assign(rho.begin(), rho.begin() + N);
+  flags.assign(p.flags.begin(), p.flags.begin() + N);
+}
+
+int native_engine_t::cell_of(ehfloat x, ehfloat y, ehfloat z) const
+{
+  ehfloat p[3] = { x, y, z };
+  int index3[3];
+  for (int d = 0; d < 3; ++d)
+  {
+    ehfloat g = std::floor((p[d] - minbound[d]) * gridinvH);
+    if (g < 0 || g >= gridsize[d])
+    {
+      return gridcells;
+    }
+    index3[d] = (int)g;
+  }
+  return (index3[2] * gridsize[1] + index3[1]) * gridsize[0] + index3[0];
+}
+void native_engine_t::grid_sort()
+{
+  particles_t& p = particles;
+  for_particles(
+      [&](int i) { cellindex[i] = cell_of(p.px[i], p.py[i], p.pz[i]); });
+
+  // counting sort; serial, but only touches one int per particle
+  std::fill(grid_begin.begin(), grid_begin.end(), 0);
+  for (int i = 0; i < N; ++i)
+  {
+    ++grid_begin[cellindex[i] + 1];
+  }
+  std::partial_sum(grid_begin.begin(), grid_begin.end(), grid_begin.begin());
+  {
+    std::vector<int> offset(grid_begin.begin(), grid_begin.end() - 1);
+    for (int i = 0; i < N; ++i)
+    {
+      sort_order[offset[cellindex[i]]++] = i;
+    }
+  }
+
+  // gather the attributes into sorted order
+  for_particles([&](int to) {
+    int from = sort_order[to];
+    pong.px[to] = p.px[from];
+    pong.py[to] = p.py[from];
+    pong.pz[to] = p.pz[from];
+    pong.vx[to] = p.vx[from];
+    pong.vy[to] = p.vy[from];
+    pong.vz[to] = p.vz[from];
+    pong.svx[to] = p.svx[from];
+    pong.svy[to] = p.svy[from];
+    pong.svz[to] = p.svz[from];
+    pong.flags[to] = p.flags[from];
+    pong.color[to] = p.color[from];
+  });
+  std::swap(particles, pong);
+  // particles in the overflow cell are dropped
+  N = grid_begin[gridcells];
+}
+void native_engine_t::make_neighbors()
+{
+  particles_t& p = particles;
+  ehfloat const r2max = gridH * gridH;
+  bool const half = half_neighbors;
+  // f(j) for the particles within gridH of i, only j > i for the half list;
+  // rows of the 3x3x3 stencil are contiguous ranges of the row-major cells
+  auto for_each_candidate = [&](int i, auto const& f) {
+    ehfloat pi[3] = { p.px[i], p.py[i], p.pz[i] };
+    int lo[3], hi[3];
+    for (int d = 0; d < 3; ++d)
+    {
+      int g = (int)std::floor((pi[d] - minbound[d]) * gridinvH);
+      lo[d] = std::max(g - 1, 0);
+      hi[d] = std::min(g + 1, gridsize[d] - 1);
+    }
+    for (int gz = lo[2]; gz <= hi[2]; ++gz)
+    {
+      for (int gy = lo[1]; gy <= hi[1]; ++gy)
+      {
+        int row = (gz * gridsize[1] + gy) * gridsize[0];
+        int end = grid_begin[row + hi[0] + 1];
+        int begin = grid_begin[row + lo[0]];
+        // particles are sorted by cell, so j > i starts past i
+        for (int j = half ? std::max(begin, i + 1) : begin; j < end; ++j)
+        {
+          ehfloat dx = pi[0] - p.px[j];
+          ehfloat dy = pi[1] - p.py[j];
+          ehfloat dz = pi[2] - p.pz[j];
+          if (dx * dx + dy * dy + dz * dz <= r2max)
+          {
+            f(j);
+          }
+        }
+      }
+    }
+  };
+
+  for_particles([&](int i) {
+    int count = 0;
+    for_each_candidate(i, [&](int) { ++count; });
+    neighbor_begin[i + 1] = count;
+  });
+  neighbor_begin[0] = 0;
+  std::partial_sum(neighbor_begin.begin(), neighbor_begin.begin() + N + 1,
+                   neighbor_begin.begin());
+  neighbors.resize(neighbor_begin[N]);
+  for_particles([&](int i) {
+    int k = neighbor_begin[i];
+    for_each_candidate(i, [&](int j) { neighbors[k++] = j; });
+  });
+}
+void native_engine_t::calculate_rho()
+{
+  if (half_neighbors)
+  {
+    calculate_rho_half();
+    return;
+  }
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    ehacc density = 0;
+    ehacc density_rate = 0;
+    ehacc numdensity = 0;
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      ehfloat rx = p.px[i] - p.px[j];
+      ehfloat ry = p.py[i] - p.py[j];
+      ehfloat rz = p.pz[i] - p.pz[j];
+      ehfloat r2 = rx * rx + ry * ry + rz * rz;
+      if (r2 > H * H)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat w = poly6_norm * q * q * q;
+      ehfloat g = poly6_grad_norm * q * q;
+      ehfloat mj = mass;
+      if (p.flags[j] & EH_PARTICLE_STATIC)
+      {
+        mj *= STATIC_MASS;
+      }
+      density += mj * w;
+      density_rate += mj * g
+                      * ((p.vx[i] - p.vx[j]) * rx + (p.vy[i] - p.vy[j]) * ry
+                         + (p.vz[i] - p.vz[j]) * rz);
+      numdensity += w;
+    }
+    rho[i] = std::max((ehfloat)density, rho0);
+    drho[i] = density_rate;
+    V[i] = (p.flags[i] & EH_PARTICLE_STATIC ? STATIC_MASS : 1.0) / numdensity;
+  });
+}
+void native_engine_t::calculate_nonpressure_force()
+{
+  if (half_neighbors)
+  {
+    calculate_nonpressure_force_half();
+    return;
+  }
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    if (p.flags[i] & EH_PARTICLE_STATIC)
+    {
+      return;
+    }
+    int const begin = neighbor_begin[i];
+    int const end = neighbor_begin[i + 1];
+
+    // velocity gradient; row a is grad v_a
+    ehfloat gradv[3][3] = {};
+    for (int k = begin; k < end; ++k)
+    {
+      int j = neighbors[k];
+      ehfloat r[3] = { p.px[i] - p.px[j], p.py[i] - p.py[j],
+                       p.pz[i] - p.pz[j] };
+      ehfloat r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+      if (r2 > H * H || (p.flags[j] & EH_PARTICLE_STATIC))
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat g = poly6_grad_norm * q * q * V[j];
+      ehfloat vji[3] = { p.vx[j] - p.vx[i], p.vy[j] - p.vy[i],
+                         p.vz[j] - p.vz[i] };
+      for (int a = 0; a < 3; ++a)
+      {
+        for (int b = 0; b < 3; ++b)
+        {
+          gradv[a][b] += vji[a] * g * r[b];
+        }
+      }
+    }
+
+    ehfloat lapv[3] = { 0, 0, 0 };
+    for (int k = begin; k < end; ++k)
+    {
+      int j = neighbors[k];
+      if (j == i || (p.flags[j] & EH_PARTICLE_STATIC))
+      {
+        continue;
+      }
+      ehfloat e[3] = { p.px[i] - p.px[j], p.py[i] - p.py[j],
+                       p.pz[i] - p.pz[j] };
+      ehfloat r2 = e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+      if (r2 > H * H || r2 < 1e-10)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat invlen = 1.0 / std::sqrt(r2);
+      // dot(e_ij, grad W_ij V_j) with e_ij normalized
+      ehfloat edkdV = poly6_grad_norm * q * q * V[j] * r2 * invlen;
+      for (int d = 0; d < 3; ++d)
+      {
+        e[d] *= invlen;
+      }
+      ehfloat vij[3] = { p.vx[i] - p.vx[j], p.vy[i] - p.vy[j],
+                         p.vz[i] - p.vz[j] };
+      for (int a = 0; a < 3; ++a)
+      {
+        ehfloat edgu = gradv[a][0] * e[0] + gradv[a][1] * e[1]
+                       + gradv[a][2] * e[2];
+        lapv[a] += 2 * (vij[a] * invlen - edgu) * edkdV;
+      }
+    }
+    fx[i] = rho[i] * gravity[0] + mu * lapv[0];
+    fy[i] = rho[i] * gravity[1] + mu * lapv[1];
+    fz[i] = rho[i] * gravity[2] + mu * lapv[2];
+  });
+}
+void native_engine_t::advect_phase1()
+{
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    const ehfloat rho_t = rho[i];
+    rho[i] = std::max(rho_t + dt * drho[i], rho0);
+    pressure_rho2[i] = pressure_over_rho2(i);
+    if (p.flags[i] & EH_PARTICLE_STATIC)
+    {
+      return;
+    }
+    ehfloat accel[3] = { fx[i] / rho_t, fy[i] / rho_t, fz[i] / rho_t };
+    p.px[i] += dt * p.vx[i] + 0.5 * dt * dt * accel[0];
+    p.py[i] += dt * p.vy[i] + 0.5 * dt * dt * accel[1];
+    p.pz[i] += dt * p.vz[i] + 0.5 * dt * dt * accel[2];
+    p.vx[i] += dt * accel[0];
+    p.vy[i] += dt * accel[1];
+    p.vz[i] += dt * accel[2];
+  });
+}
+ehfloat native_engine_t::pressure_over_rho2(int i) const
+{
+  ehfloat pressure = static_pressure;
+  if ((particles.flags[i] & EH_PARTICLE_STATIC) == 0)
+  {
+    pressure = pressure0 * (std::pow(rho[i] / rho0, gamma) - 1.0);
+  }
+  return pressure / (rho[i] * rho[i]);
+}
+void native_engine_t::calculate_pressure()
+{
+  for_particles([&](int i) { pressure_rho2[i] = pressure_over_rho2(i); });
+}
+void native_engine_t::calculate_pressure_force()
+{
+  if (half_neighbors)
+  {
+    calculate_pressure_force_half();
+    return;
+  }
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    if (p.flags[i] & EH_PARTICLE_STATIC)
+    {
+      return;
+    }
+    ehacc accel[3] = { 0, 0, 0 };
+    const ehfloat pi = pressure_rho2[i];
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      ehfloat rx = p.px[i] - p.px[j];
+      ehfloat ry = p.py[i] - p.py[j];
+      ehfloat rz = p.pz[i] - p.pz[j];
+      ehfloat r2 = rx * rx + ry * ry + rz * rz;
+      if (r2 > H * H)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat s = -poly6_grad_norm * q * q * mass * (pi + pressure_rho2[j]);
+      if (p.flags[j] & EH_PARTICLE_STATIC)
+      {
+        s *= STATIC_MASS;
+      }
+      accel[0] += s * rx;
+      accel[1] += s * ry;
+      accel[2] += s * rz;
+    }
+    ax[i] = accel[0];
+    ay[i] = accel[1];
+    az[i] = accel[2];
+  });
+}
+void native_engine_t::advect_phase2()
+{
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    if (p.flags[i] & EH_PARTICLE_STATIC)
+    {
+      return;
+    }
+    p.px[i] += 0.5 * dt * dt * ax[i];
+    p.py[i] += 0.5 * dt * dt * ay[i];
+    p.pz[i] += 0.5 * dt * dt * az[i];
+    p.vx[i] += dt * ax[i];
+    p.vy[i] += dt * ay[i];
+    p.vz[i] += dt * az[i];
+  });
+}
+// Each pair of the half list is evaluated once from the lower index and
+// added to both particles; density and its rate are symmetric in i and j,
+// the pressure force is antisymmetric.
+void native_engine_t::calculate_rho_half()
+{
+  particles_t& p = particles;
+  auto mass_of = [&](int i) {
+    return p.flags[i] & EH_PARTICLE_STATIC ? mass * STATIC_MASS : mass;
+  };
+  // the list has no self pair; W(0) = poly6_norm
+  for_particles([&](int i) {
+    pair_sum[0][i] = mass_of(i) * poly6_norm;
+    pair_sum[1][i] = 0;
+    pair_sum[2][i] = poly6_norm;
+  });
+  for_particles_colored([&](int i) {
+    const ehfloat mi = mass_of(i);
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      ehfloat rx = p.px[i] - p.px[j];
+      ehfloat ry = p.py[i] - p.py[j];
+      ehfloat rz = p.pz[i] - p.pz[j];
+      ehfloat r2 = rx * rx + ry * ry + rz * rz;
+      if (r2 > H * H)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat w = poly6_norm * q * q * q;
+      // dot(v_ij, grad W_ij), the same seen from j
+      ehfloat vdotg = poly6_grad_norm * q * q
+                      * ((p.vx[i] - p.vx[j]) * rx + (p.vy[i] - p.vy[j]) * ry
+                         + (p.vz[i] - p.vz[j]) * rz);
+      ehfloat mj = mass_of(j);
+      pair_sum[0][i] += mj * w;
+      pair_sum[0][j] += mi * w;
+      pair_sum[1][i] += mj * vdotg;
+      pair_sum[1][j] += mi * vdotg;
+      pair_sum[2][i] += w;
+      pair_sum[2][j] += w;
+    }
+  });
+  for_particles([&](int i) {
+    rho[i] = std::max((ehfloat)pair_sum[0][i], rho0);
+    drho[i] = pair_sum[1][i];
+    V[i] = (p.flags[i] & EH_PARTICLE_STATIC ? STATIC_MASS : 1.0)
+           / pair_sum[2][i];
+  });
+}
+void native_engine_t::calculate_nonpressure_force_half()
+{
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    std::fill_n(gradv.begin() + 9 * i, 9, 0);
+    for (auto& sum : pair_sum)
+    {
+      sum[i] = 0;
+    }
+  });
+  // static particles neither receive nor exert the viscous force
+  auto fluid = [&](int i) { return (p.flags[i] & EH_PARTICLE_STATIC) == 0; };
+
+  // velocity gradients first, the laplacian needs those of both particles
+  for_particles_colored([&](int i) {
+    if (!fluid(i))
+    {
+      return;
+    }
+    ehfloat* gi = &gradv[9 * i];
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      ehfloat r[3] = { p.px[i] - p.px[j], p.py[i] - p.py[j],
+                       p.pz[i] - p.pz[j] };
+      ehfloat r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+      if (r2 > H * H || !fluid(j))
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat g = poly6_grad_norm * q * q;
+      ehfloat vji[3] = { p.vx[j] - p.vx[i], p.vy[j] - p.vy[i],
+                         p.vz[j] - p.vz[i] };
+      // v_ij (x) grad W_ji = v_ji (x) grad W_ij
+      ehfloat* gj = &gradv[9 * j];
+      for (int a = 0; a < 3; ++a)
+      {
+        for (int b = 0; b < 3; ++b)
+        {
+          gi[3 * a + b] += vji[a] * g * V[j] * r[b];
+          gj[3 * a + b] += vji[a] * g * V[i] * r[b];
+        }
+      }
+    }
+  });
+
+  for_particles_colored([&](int i) {
+    if (!fluid(i))
+    {
+      return;
+    }
+    ehfloat const* gi = &gradv[9 * i];
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      if (!fluid(j))
+      {
+        continue;
+      }
+      ehfloat e[3] = { p.px[i] - p.px[j], p.py[i] - p.py[j],
+                       p.pz[i] - p.pz[j] };
+      ehfloat r2 = e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+      if (r2 > H * H || r2 < 1e-10)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat invlen = 1.0 / std::sqrt(r2);
+      // dot(e_ij, grad W_ij), equal to dot(e_ji, grad W_ji)
+      ehfloat edk = poly6_grad_norm * q * q * r2 * invlen;
+      for (int d = 0; d < 3; ++d)
+      {
+        e[d] *= invlen;
+      }
+      ehfloat vij[3] = { p.vx[i] - p.vx[j], p.vy[i] - p.vy[j],
+                         p.vz[i] - p.vz[j] };
+      ehfloat const* gj = &gradv[9 * j];
+      for (int a = 0; a < 3; ++a)
+      {
+        ehfloat edgu_i = gi[3 * a] * e[0] + gi[3 * a + 1] * e[1]
+                         + gi[3 * a + 2] * e[2];
+        ehfloat edgu_j = gj[3 * a] * e[0] + gj[3 * a + 1] * e[1]
+                         + gj[3 * a + 2] * e[2];
+        pair_sum[a][i] += 2 * (vij[a] * invlen - edgu_i) * edk * V[j];
+        pair_sum[a][j] += 2 * (edgu_j - vij[a] * invlen) * edk * V[i];
+      }
+    }
+  });
+  for_particles([&](int i) {
+    if (!fluid(i))
+    {
+      return;
+    }
+    fx[i] = rho[i] * gravity[0] + mu * pair_sum[0][i];
+    fy[i] = rho[i] * gravity[1] + mu * pair_sum[1][i];
+    fz[i] = rho[i] * gravity[2] + mu * pair_sum[2][i];
+  });
+}
+void native_engine_t::calculate_pressure_force_half()
+{
+  particles_t& p = particles;
+  for_particles([&](int i) {
+    for (auto& sum : pair_sum)
+    {
+      sum[i] = 0;
+    }
+  });
+  for_particles_colored([&](int i) {
+    const bool static_i = p.flags[i] & EH_PARTICLE_STATIC;
+    const ehfloat pi = pressure_rho2[i];
+    for (int k = neighbor_begin[i]; k < neighbor_begin[i + 1]; ++k)
+    {
+      int j = neighbors[k];
+      const bool static_j = p.flags[j] & EH_PARTICLE_STATIC;
+      if (static_i && static_j)
+      {
+        continue;
+      }
+      ehfloat r[3] = { p.px[i] - p.px[j], p.py[i] - p.py[j],
+                       p.pz[i] - p.pz[j] };
+      ehfloat r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+      if (r2 > H * H)
+      {
+        continue;
+      }
+      ehfloat q = std::max(1.0 - r2 * invH * invH, 0.0);
+      ehfloat s = -poly6_grad_norm * q * q * mass * (pi + pressure_rho2[j]);
+      // static particles only push; the mass factor is the other one's
+      ehfloat si = static_j ? s * STATIC_MASS : s;
+      ehfloat sj = static_i ? s * STATIC_MASS : s;
+      for (int d = 0; d < 3; ++d)
+      {
+        if (!static_i)
+        {
+          pair_sum[d][i] += si * r[d];
+        }
+        if (!static_j)
+        {
+          pair_sum[d][j] -= sj * r[d];
+        }
+      }
+    }
+  });
+  for_particles([&](int i) {
+    ax[i] = pair_sum[0][i];
+    ay[i] = pair_sum[1][i];
+    az[i] = pair_sum[2][i];
+  });
+}
+void native_engine_t::step()
+{
+  // phase names follow the kernels of engine_t
+  timed("grid_sort", [&] { grid_sort(); });
+  timed("make_neighborlist", [&] { make_neighbors(); });
+  timed("calculate_rho", [&] { calculate_rho(); });
+  timed("calculate_nonpressure_force",
+        [&] { calculate_nonpressure_force(); });
+  timed("advect_phase1", [&] { advect_phase1(); });
+  if (predicted_density == false)
+  {
+    timed("calculate_rho", [&] { calculate_rho(); });
+    timed("calculate_pressure", [&] { calculate_pressure(); });
+  }
+  timed("calculate_pressure_force", [&] { calculate_pressure_force(); });
+  timed("advect_phase2", [&] { advect_phase2(); });
+  time += dt;
+  ++step_count;
+}
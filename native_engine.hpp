@@ -0,0 +1,218 @@
+#pragma once
+#include "engine.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Fixed set of worker threads; the calling thread joins every job. Blocks
+// are claimed one at a time from a shared counter, so threads that run out
+// of work take over the remaining blocks of slower ones.
+struct thread_pool_t
+{
+  explicit thread_pool_t(int threads);
+  ~thread_pool_t();
+  // f(block) for every block in [0, blocks); returns when all are done
+  void parallel_for(int blocks, std::function<void(int)> const& f);
+  int size() const
+  {
+    return (int)workers.size() + 1;
+  }
+
+private:
+  void work();
+  void run_blocks();
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::function<void(int)> const* job = nullptr;
+  int job_blocks = 0;
+  std::atomic<int> next_block { 0 };
+  // workers still inside the current job
+  int busy = 0;
+  long generation = 0;
+  bool quit = false;
+};
+
+// The WCSPH step of kernels.cl (grid sort, neighbor list, calculate_rho,
+// calculate_nonpressure_force, advect_phase1, calculate_pressure_force,
+// advect_phase2) in plain C++ on a thread pool, for hosts without a
+// worthwhile OpenCL device. Particles are kept sorted by cell and processed
+// in blocks of consecutive particles, i.e. of neighboring cells.
+//
+// Only the default pipeline is implemented: iisph and adaptive_dt are
+// rejected by set(); the grid ordering, neighbor list and sort options only
+// change how engine_t gets there and are ignored.
+struct native_engine_t : public backend_t
+{
+  // particles per parallel_for block
+  static constexpr int block_size = 256;
+
+  int max_particle_count = 0;
+  int N = 0;
+  int step_count = 0;
+  ehfloat time = 0;
+
+  ehfloat minbound[3];
+  ehfloat gravity[3];
+  int gridsize[3];
+  int gridcells;
+  ehfloat H;
+  ehfloat invH;
+  ehfloat gridH;
+  ehfloat gridinvH;
+  ehfloat gap;
+  ehfloat mu;
+  ehfloat mass;
+  ehfloat dt;
+  ehfloat rho0;
+  ehfloat gamma;
+  ehfloat pressure0;
+  ehfloat static_pressure;
+  // poly6 normalization of W and of grad W
+  ehfloat poly6_norm;
+  ehfloat poly6_grad_norm;
+
+  int thread_count = 0;
+  std::unique_ptr<thread_pool_t> pool;
+
+  // attributes carried along by grid_sort, one array per component
+  struct particles_t
+  {
+    std::vector<ehfloat> px, py, pz;
+    std::vector<ehfloat> vx, vy, vz;
+    std::vector<ehfloat> svx, svy, svz;
+    std::vector<cl_int> flags;
+    std::vector<cl_int> color;
+    void resize(int n);
+  } particles, pong;
+
+  std::vector<ehfloat> rho;
+  std::vector<ehfloat> drho;
+  std::vector<ehfloat> V;
+  std::vector<ehfloat> pressure_rho2;
+  // nonpressure force, then the pressure acceleration
+  std::vector<ehfloat> fx, fy, fz;
+  std::vector<ehfloat> ax, ay, az;
+
+  // particles of cell c are [grid_begin[c], grid_begin[c+1]); the last
+  // cell collects the particles outside the bound, which grid_sort drops
+  std::vector<int> grid_begin;
+  std::vector<int> cellindex;
+  std::vector<int> sort_order;
+  // neighbors of i are neighbors[neighbor_begin[i] .. neighbor_begin[i+1])
+  std::vector<int> neighbor_begin;
+  std::vector<int> neighbors;
+
+  // param_t::half_neighbors; the list then only holds j > i
+  bool half_neighbors = false;
+  // param_t::predicted_density; false adds the second calculate_rho
+  bool predicted_density = true;
+  // cells of color c are colored_cells[color_begin[c] .. color_begin[c+1]);
+  // the color is (x%3, y%3, z%3) of the cell index
+  std::vector<int> colored_cells;
+  std::vector<int> color_begin;
+  // per-particle sums scattered to by the pair loops
+  std::vector<ehacc> pair_sum[3];
+  // velocity gradient of each particle, row-major 3x3
+  std::vector<ehfloat> gradv;
+
+  // host time of each phase since reset_profile(), ms
+  std::map<std::string, double> phase_ms;
+
+  void set(param_t& p) override;
+  void load() override;
+  void add_particle(particle_info_t const& info) override;
+  void calculate_mass() override;
+  void step() override;
+  void sync() override
+  {
+  }
+  int particle_count() override
+  {
+    return N;
+  }
+  ehfloat simulated_time() override
+  {
+    return time;
+  }
+  std::string device_name() override
+  {
+    return "native (" + std::to_string(thread_count) + " threads)";
+  }
+  void read_particles(std::vector<ehfloat3>& position,
+                      std::vector<ehfloat3>& velocity,
+                      std::vector<ehfloat>& rho_out,
+                      std::vector<cl_int>& flags) override;
+  std::map<std::string, double> profile_totals() override
+  {
+    return phase_ms;
+  }
+  void reset_profile() override
+  {
+    phase_ms.clear();
+  }
+
+  // f(i) for every particle, in blocks on the pool
+  template <typename F>
+  void for_particles(F const& f)
+  {
+    pool->parallel_for((N + block_size - 1) / block_size, [&](int block) {
+      int end = std::min(N, (block + 1) * block_size);
+      for (int i = block * block_size; i < end; ++i)
+      {
+        f(i);
+      }
+    });
+  }
+  // f(i) for every particle, one cell per block and one color at a time.
+  // Cells of a color are three cells apart, so f may also write to the
+  // neighbors of i without racing another thread.
+  template <typename F>
+  void for_particles_colored(F const& f)
+  {
+    for (int c = 0; c < 27; ++c)
+    {
+      int const* cells = colored_cells.data() + color_begin[c];
+      pool->parallel_for(color_begin[c + 1] - color_begin[c], [&](int b) {
+        int end = grid_begin[cells[b] + 1];
+        for (int i = grid_begin[cells[b]]; i < end; ++i)
+        {
+          f(i);
+        }
+      });
+    }
+  }
+  // run f and add its duration to phase_ms[name]
+  template <typename F>
+  void timed(char const* name, F const& f)
+  {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    phase_ms[name] += std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - begin)
+                          .count();
+  }
+
+  // cell of a position; gridcells if outside the bound
+  int cell_of(ehfloat x, ehfloat y, ehfloat z) const;
+  void grid_sort();
+  void make_neighbors();
+  void calculate_rho();
+  void calculate_nonpressure_force();
+  void advect_phase1();
+  // pressure / rho^2 of particle i from its current rho
+  ehfloat pressure_over_rho2(int i) const;
+  void calculate_pressure();
+  void calculate_pressure_force();
+  void advect_phase2();
+  // the same phases over the half neighbor list
+  void calculate_rho_half();
+  void calculate_nonpressure_force_half();
+  void calculate_pressure_force_half();
+};